@@ -1,7 +1,12 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
+// The buffer cache is a hash table of buf structures holding
+// cached copies of disk block contents, one lock per bucket.
+// Buffers come from a slab cache: the cache keeps at least
+// NBUF of them and grows while it holds less than its share
+// of free memory (see bmax), shrinking again when memory
+// gets tight.  Buffers holding blocks are recycled in CLOCK
+// order.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
@@ -22,34 +27,189 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
+#include "memlayout.h"
+
+#define BPERPG  (PGSIZE / sizeof(struct buf))  // about, per slab page
+// the most buffers bmax() can allow, and hash buckets,
+// keyed by (dev, blockno), for about four of them each.
+#define MAXBUF  ((PHYSTOP - KERNBASE) / PGSIZE / BUFMEMDIV * BPERPG)
+#define NBUCKET (MAXBUF / 4 + 1)
+
+struct bucket {
+  struct spinlock lock;  // protects the chain and each buf's refcnt
+  struct buf *head;
+};
 
 struct {
+  // held while a buffer moves between buckets, so that
+  // only one cpu at a time looks for a victim. it also
+  // protects the free list and the clock ring.
   struct spinlock lock;
-  struct buf buf[NBUF];
-
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct kmem_cache *cache;
+  int nbuf;              // buffers allocated
+  uint shrunk;           // ticks at the last bshrink()
+  int max;               // bmax(), as of ticks maxat
+  uint maxat;
+  struct buf *free;      // buffers holding no block
+  struct buf *hand;      // clock hand, in the ring of the rest
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Get a new, unused buffer. Called with bcache.lock held.
+static struct buf*
+balloc(void)
+{
+  struct buf *b;
+
+  if((b = kmem_cache_alloc(bcache.cache)) == 0)
+    return 0;
+  initsleeplock(&b->lock, "buffer");
+  b->dev = 0;
+  b->blockno = 0;
+  b->valid = 0;
+  b->disk = 0;
+  b->refcnt = 0;
+  b->used = 0;
+  bcache.nbuf++;
+  return b;
+}
+
+// Put b in the clock ring just behind the hand, so the
+// hand comes to it last. Called with bcache.lock held.
+static void
+bring(struct buf *b)
+{
+  struct buf *h = bcache.hand;
+
+  if(h == 0){
+    b->cnext = b->cprev = b;
+    bcache.hand = b;
+    return;
+  }
+  b->cnext = h;
+  b->cprev = h->cprev;
+  h->cprev->cnext = b;
+  h->cprev = b;
+}
+
+// Take b out of the clock ring. Called with bcache.lock held.
+static void
+bunring(struct buf *b)
+{
+  if(b->cnext == b){
+    bcache.hand = 0;
+    return;
+  }
+  b->cprev->cnext = b->cnext;
+  b->cnext->cprev = b->cprev;
+  if(bcache.hand == b)
+    bcache.hand = b->cnext;
+}
+
+// Most buffers the cache should hold: 1/BUFMEMDIV of the
+// memory that is free or already holding buffers.
+static int
+bmax(void)
+{
+  uint64 total, used, pages;
+  int n;
+
+  total = get_total_pages();
+  used = get_used_pages();
+  pages = used < total ? total - used : 0;
+  pages += bcache.nbuf / BPERPG;
+  n = pages / BUFMEMDIV * BPERPG;
+  return n < NBUF ? NBUF : n;
+}
+
+// bmax() takes every allocator lock, so misses use a copy
+// refreshed at most once a tick. Called with bcache.lock held.
+static int
+blimit(void)
+{
+  if(bcache.max == 0 || bcache.maxat != ticks){
+    bcache.max = bmax();
+    bcache.maxat = ticks;
+  }
+  return bcache.max;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf), 0);
+
+  // the first NBUF buffers start out on the free list.
+  acquire(&bcache.lock);
+  while(bcache.nbuf < NBUF){
+    if((b = balloc()) == 0)
+      panic("binit");
+    b->next = bcache.free;
+    bcache.free = b;
+  }
+  release(&bcache.lock);
+}
+
+// Search bk for the block. bk->lock must be held.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Find a buffer to recycle, and take it out of its bucket and
+// the clock ring: a free one if there is one, else the first
+// unused buffer the clock hand comes to that has not been
+// released since the hand last passed it. Called with
+// bcache.lock held, which keeps each buffer's bucket fixed.
+// Returns 0 if two trips round the ring find every buffer
+// in use.
+static struct buf*
+bvictim(void)
+{
+  struct bucket *bk;
+  struct buf *b, **pp;
+  int i;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  if((b = bcache.free) != 0){
+    bcache.free = b->next;
+    return b;
+  }
+  for(i = 0; bcache.hand && i < 2*bcache.nbuf; i++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0 && !b->used){
+      for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+        ;
+      *pp = b->next;
+      release(&bk->lock);
+      bunring(b);
+      return b;
+    }
+    b->used = 0;
+    release(&bk->lock);
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +218,59 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b, *v;
+  int max;
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached. Only a cpu holding bcache.lock adds buffers
+  // to a bucket, so look again before recycling one.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // grow while under the limit; past it, or if memory has
+  // run out, recycle one.
+  b = 0;
+  max = blimit();
+  if(bcache.nbuf < max)
+    b = balloc();
+  if(b == 0 && (b = bvictim()) == 0 && (b = balloc()) == 0)
+    panic("bget: no buffers");
+  // the limit fell since the cache last grew: give
+  // another buffer back.
+  if(bcache.nbuf > max && (v = bvictim()) != 0){
+    kmem_cache_free(bcache.cache, v);
+    bcache.nbuf--;
   }
-  panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->used = 0;
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  bring(b);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +287,59 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading up to RABLOCKS blocks into the cache in the
+// background, as one batch, skipping those cached already.
+// Each buffer stays locked until the disk is done with it, so
+// a bread() of the block in the meantime just waits for that
+// read.
+void
+bprefetch(uint dev, uint *blocknos, int n)
+{
+  struct bucket *bk;
+  struct buf *b, *bs[RABLOCKS];
+  int i, k, started;
+
+  if(n > RABLOCKS)
+    panic("bprefetch");
+
+  k = 0;
+  for(i = 0; i < n; i++){
+    bk = bhash(dev, blocknos[i]);
+    acquire(&bk->lock);
+    b = blookup(bk, dev, blocknos[i]);
+    release(&bk->lock);
+    if(b)
+      continue;
+    b = bget(dev, blocknos[i]);
+    if(b->valid)
+      brelse(b);
+    else
+      bs[k++] = b;
+  }
+
+  started = virtio_disk_read_async(bs, k);
+  for(i = started; i < k; i++)
+    brelse(bs[i]);
+}
+
+// The disk has finished a read started by bprefetch().
+// Called from the disk interrupt, so release b on behalf
+// of the process that started it.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->used = 1;
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +349,85 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the n locked bufs in bs to disk, as one batch.
+// Sorts bs by block number, so that the driver can merge
+// adjacent blocks into one request.
+void
+bwritev(struct buf **bs, int n)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+    b = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > b->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+  virtio_disk_start(bs, n, 1);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it used, so the clock hand passes it over once.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  if (b->refcnt == 0)
+    b->used = 1;
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Free unused buffers while the cache holds more than bmax()
+// allows, e.g. after processes have grown. Called from the
+// idle loop, at most once a tick. Returns how many were freed.
+int
+bshrink(void)
+{
+  struct buf *b;
+  int n = 0, max;
 
+  if(bcache.shrunk == ticks)
+    return 0;
+  acquire(&bcache.lock);
+  bcache.shrunk = ticks;
+  max = blimit();
+  while(bcache.nbuf > max && (b = bvictim()) != 0){
+    kmem_cache_free(bcache.cache, b);
+    bcache.nbuf--;
+    n++;
+  }
+  release(&bcache.lock);
+  return n;
+}
@@ -5,8 +5,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int used;         // released since the clock hand last passed
+  struct buf *next; // hash bucket chain, or bcache.free
+  struct buf *cnext; // clock ring
+  struct buf *cprev;
   uchar data[BSIZE];
 };
 
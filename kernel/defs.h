@@ -10,9 +10,12 @@ struct stat;
 struct superblock;
 struct proc_info;
 struct top;
+struct kmem_cache;
+struct slab_info;
 struct child_processes;
 struct report;
 struct report_traps;
+struct mlfq_conf;
 
 // bio.c
 void            binit(void);
@@ -21,6 +24,10 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
+void            bprefetch(uint, uint*, int);
+void            bwritev(struct buf**, int);
+void            bdone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -39,6 +46,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int n);
 
 // fs.c
 void            fsinit(int);
@@ -68,23 +76,44 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kzalloc(void);
+int             kzero_fill(void);
+void            buddyinit(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            ksplit(void *, int);
+void            buddy_stats(int *);
 void            kinit(void);
 void            increment(uint64);
 int             decrement(uint64);
+int             krefcnt(uint64);
 uint64          get_total_pages();
 uint64          get_used_pages();
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_sync(void);
+int             log_opblocks(void);
 void            begin_op(void);
 void            end_op(void);
 
+// pcache.c
+void            pcacheinit(void);
+uint64          pcache_get(struct inode*, uint, int);
+void            pcache_pin(uint64);
+void            pcache_unpin(uint64);
+void            pcache_inval(struct inode*);
+void            pcache_write(struct inode*, int, uint64, uint, uint);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipesplicein(struct pipe*, struct file*, int);
+int             pipespliceout(struct pipe*, struct file*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -110,6 +139,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -119,6 +149,9 @@ void            procdump(void);
 void            fill_top(struct top*);
 int             fill_chp(struct child_processes*);
 int             reportraps(struct report_traps*);
+void            mlfq_tick(uint);
+void            mlfq_get(struct mlfq_conf*);
+int             mlfq_set(struct mlfq_conf*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -137,6 +170,13 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             slab_stats(struct slab_info*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -161,6 +201,10 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+uint64          timer_now(void);
+void            timer_stop(void);
+void            timer_start(void);
+void            ipi(int);
 int             fill_traps(struct report_traps*, int);
 
 // uart.c
@@ -181,10 +225,19 @@ uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int);
 uint64          walkaddr(pagetable_t, uint64);
+int             cowfault(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int);
+void            vma_prefault(uint64, uint64);
+int             vma_dup(struct proc*, struct proc*);
+void            vma_free(struct proc*);
+uint64          vma_base(struct proc*);
+uint64          vma_mmap(uint64, int, int, struct inode*, uint64, uint64);
+int             vma_munmap(uint64, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -198,6 +251,9 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+int             virtio_disk_read_async(struct buf **, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -7,8 +7,6 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -29,8 +27,11 @@ exec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
+  struct vma vma[NVMA], *v;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -49,7 +50,9 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the program's segments.  Nothing is read yet;
+  // vmfault() pages them in from ip as they are touched.
+  v = vma;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,12 +64,18 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz >= TRAPFRAME)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(v == &vma[NVMA])
       goto bad;
+    v->start = ph.vaddr;
+    v->end = PGROUNDUP(ph.vaddr + ph.memsz);
+    v->perm = flags2perm(ph.flags) | PTE_R;
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -121,46 +130,29 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vma_free(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->tlb_pa = 0;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
 
+  memmove(p->vma, vma, sizeof(vma));
+
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
-  if(ip){
+  if(ip)
     iunlockput(ip);
-    end_op();
-  }
+  else
+    begin_op();
+  for(v = vma; v < &vma[NVMA]; v++)
+    if(v->ip)
+      iput(v->ip);
+  end_op();
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
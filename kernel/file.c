@@ -14,15 +14,18 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+// Files come from a slab cache of at most NFILE;
+// ftable.lock protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file), NFILE);
 }
 
 // Allocate a file structure.
@@ -31,16 +34,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +67,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -147,12 +144,10 @@ filewrite(struct file *f, uint64 addr, int n)
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = MAXWRITE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -180,3 +175,66 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Copy up to n bytes between two inode files through
+// a kernel page, at most MAXWRITE bytes per transaction
+// as in filewrite().
+static int
+inodesplice(struct file *in, struct file *out, int n)
+{
+  char *buf;
+  int i = 0, m, r, w;
+
+  if((buf = kalloc()) == 0)
+    return -1;
+  while(i < n){
+    m = n - i;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    if(m > MAXWRITE)
+      m = MAXWRITE;
+    ilock(in->ip);
+    if((r = readi(in->ip, 0, (uint64)buf, in->off, m)) > 0)
+      in->off += r;
+    iunlock(in->ip);
+    if(r <= 0)
+      break;
+
+    begin_op();
+    ilock(out->ip);
+    if((w = writei(out->ip, 0, (uint64)buf, out->off, r)) > 0)
+      out->off += w;
+    iunlock(out->ip);
+    end_op();
+
+    if(w > 0)
+      i += w;
+    if(w != r){
+      // error from writei
+      if(i == 0)
+        i = -1;
+      break;
+    }
+    if(r < m)
+      break;
+  }
+  kfree(buf);
+  return i;
+}
+
+// Move up to n bytes from in to out without copying
+// them through user space. either side may be a pipe
+// or an inode; devices are not supported.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  if(in->type == FD_INODE && out->type == FD_PIPE)
+    return pipesplicein(out->pipe, in, n);
+  if(in->type == FD_PIPE && out->type == FD_INODE)
+    return pipespliceout(in->pipe, out, n);
+  if(in->type == FD_INODE && out->type == FD_INODE)
+    return inodesplice(in, out, n);
+  return -1;
+}
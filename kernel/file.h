@@ -9,6 +9,11 @@ struct file {
   short major;       // FD_DEVICE
 };
 
+// largest write that fits in one log transaction, including
+// i-node, indirect block, allocation blocks, and 2 blocks of
+// slop for non-aligned writes. grows with the log, see log.c.
+#define MAXWRITE (((log_opblocks()-1-1-2) / 2) * BSIZE)
+
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
@@ -18,8 +23,11 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // on the itable list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ra_off;        // where a sequential read would go next
+  uint ra_blk;        // read-ahead has been started below this block
 
   short type;         // copy of disk inode
   short major;
@@ -129,12 +129,13 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: the inode table is a list of
+//   the in-memory inodes, allocated from a slab cache of
+//   at most NINODE. ip->ref tracks the number of in-memory
+//   pointers to an entry (open files and current
+//   directories). iget() finds or creates a table entry
+//   and increments its ref; iput() decrements ref, and
+//   frees the entry when it drops to zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -164,10 +165,11 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable.lock spin-lock protects the itable list and the
+// allocation of its entries. Since ip->ref indicates whether an
+// entry is still in use, and ip->dev and ip->inum indicate which
+// i-node an entry holds, one must hold itable.lock while using
+// any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -175,18 +177,15 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *list;
+  struct kmem_cache *cache;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode), NINODE);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -246,31 +245,32 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.list; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate a new entry.
+  if((ip = kmem_cache_alloc(itable.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_off = 0;
+  ip->ra_blk = 0;
+  initsleeplock(&ip->lock, "inode");
+  ip->next = itable.list;
+  itable.list = ip;
   release(&itable.lock);
 
   return ip;
@@ -357,7 +357,13 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    struct inode **pp;
+    for(pp = &itable.list; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    kmem_cache_free(itable.cache, ip);
+  }
   release(&itable.lock);
 }
 
@@ -450,6 +456,7 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  pcache_inval(ip);
 }
 
 // Copy stat information from inode.
@@ -464,6 +471,42 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// If reads of file ip have been sequential, start reading
+// the rest of this one, and the blocks past it, into the
+// buffer cache, RABLOCKS at most, so the disk works while
+// readi() copies.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, addr, blocknos[RABLOCKS];
+  int n1 = 0;
+
+  if(ip->type != T_FILE)
+    return;
+  if(off != ip->ra_off){
+    ip->ra_blk = 0;
+    return;
+  }
+
+  bn = off/BSIZE + 1;
+  if(bn < ip->ra_blk)
+    bn = ip->ra_blk;
+  end = (off + n + BSIZE - 1)/BSIZE + RABLOCKS;
+  if(end > bn + RABLOCKS)
+    end = bn + RABLOCKS;
+  if(end > (ip->size + BSIZE - 1)/BSIZE)
+    end = (ip->size + BSIZE - 1)/BSIZE;
+  for(; bn < end; bn++){
+    if((addr = bmap(ip, bn)) == 0)
+      break;
+    blocknos[n1++] = addr;
+  }
+  bprefetch(ip->dev, blocknos, n1);
+  if(bn > ip->ra_blk)
+    ip->ra_blk = bn;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -479,6 +522,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  readahead(ip, off, n);
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -492,6 +536,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  ip->ra_off = off;
   return tot;
 }
 
@@ -535,6 +580,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   // block to ip->addrs[].
   iupdate(ip);
 
+  if(tot > 0)
+    pcache_write(ip, user_src, src - tot, off - tot, tot);
+
   return tot;
 }
 
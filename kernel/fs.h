@@ -24,6 +24,10 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
+// Most data blocks in the log: its header block holds a count
+// and one block number for each.
+#define MAXLOG (BSIZE / sizeof(uint) - 1)
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
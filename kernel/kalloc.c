@@ -18,53 +18,137 @@ struct run {
   struct run *next;
 };
 
+#define KBATCH  32   // pages moved between a cpu cache and kmem at once
+#define KCACHE  64   // a cpu cache holding more than this drains a batch
+
+// Global free list, touched only on batch boundaries.
 struct {
   struct spinlock lock;
   struct run *freelist;
   uint64 total_pages;
-  uint64 used_pages;
 } kmem;
 
+// Per-CPU free-page caches.  used_pages is this cpu's
+// share of the pages in use; a page freed on another cpu
+// than the one that allocated it makes the shares skew,
+// but their (wrapping) sum is exact.
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+  uint64 used_pages;
+} kcache[NCPU];
+
+#define KZPOOL  128  // zeroed pages kept ready for kzalloc()
+#define KZBATCH 8    // pages an idle cpu zeroes before looking for work
+
+// Pages already zeroed by idle cpus.  They stay counted
+// as used, with a reference count of 1, while pooled.
 struct {
   struct spinlock lock;
-  int ref [PHYSTOP / PGSIZE + 1];
-} kref;
+  struct run *freelist;
+  int n;
+} kzero;
+
+// Buddy allocator for blocks of 2^order contiguous pages,
+// over [base, end), a region set aside at kinit.  Free
+// blocks are on doubly-linked lists so that a buddy can
+// be unlinked when it merges.
+struct bnode {
+  struct bnode *next;
+  struct bnode *prev;
+};
+
+struct {
+  struct spinlock lock;
+  char *base;
+  char *end;
+  struct bnode free[KMAXORDER+1];  // list heads
+  int nfree[KMAXORDER+1];
+  uint64 used_pages;
+} buddy;
+
+// One descriptor per managed page, in an array carved
+// from the start of the free memory at kinit.
+struct frame {
+  int ref;      // page table mappings and kernel users; atomic
+  uchar order;  // buddy block size, for the block's first page
+  uchar free;   // first page of a free buddy block?
+};
+
+static struct frame *frames;
+static char *membase;   // first managed page
+
+static inline struct frame *
+pa2frame(uint64 pa)
+{
+  return &frames[(pa - (uint64)membase) / PGSIZE];
+}
 
 void
 kinit()
 {
+  uint64 n;
+
   initlock(&kmem.lock, "kmem");
-  initlock(&kref.lock, "kref");
-  kmem.total_pages = ((char*)PHYSTOP - end) / PGSIZE;
-  freerange(end, (void*)PHYSTOP);
+  initlock(&kzero.lock, "kzero");
+  for(struct kcache *kc = kcache; kc < &kcache[NCPU]; kc++)
+    initlock(&kc->lock, "kcache");
+
+  // Descriptors for [end, PHYSTOP) would cover a few pages
+  // too many, since they themselves sit at the start of it.
+  frames = (struct frame*)PGROUNDUP((uint64)end);
+  n = (PHYSTOP - (uint64)frames) / PGSIZE;
+  membase = (char*)PGROUNDUP((uint64)(frames + n));
+  memset(frames, 0, membase - (char*)frames);
+
+  kmem.total_pages = ((char*)PHYSTOP - membase) / PGSIZE;
+  buddyinit();
+  freerange(membase, buddy.base);
+  freerange(buddy.end, (void*)PHYSTOP);
 }
 
+// Hand pages to the allocator at boot.  They have
+// never been allocated, so skip kfree's refcount.
 void
 freerange(void *pa_start, void *pa_end)
 {
+  struct run *r;
   char *p;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&kmem.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+#ifdef DEBUG_JUNK
+    memset(p, 1, PGSIZE);
+#endif
+    r = (struct run*)p;
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+  }
+  release(&kmem.lock);
 }
 
+// Drop a reference to the page at pa.
+// Returns the count before the drop.
 int
 decrement(uint64 pa)
 {
-  acquire(&kref.lock);
-  int tmp = 0;
-  if (kref.ref[pa / PGSIZE])
-    tmp = kref.ref[pa / PGSIZE]--;
-  release(&kref.lock);
-  return tmp;
+  return __sync_fetch_and_sub(&pa2frame(pa)->ref, 1);
 }
 
+// Take another reference to the page at pa.
 void
 increment(uint64 pa)
 {
-  acquire(&kref.lock);
-  ++kref.ref[pa / PGSIZE];
-  release(&kref.lock);
+  __sync_fetch_and_add(&pa2frame(pa)->ref, 1);
+}
+
+// Current reference count of the page at pa.
+int
+krefcnt(uint64 pa)
+{
+  return __atomic_load_n(&pa2frame(pa)->ref, __ATOMIC_ACQUIRE);
 }
 
 uint64
@@ -79,38 +163,154 @@ get_total_pages()
 uint64
 get_used_pages()
 {
+  uint64 used = 0;
+  for(struct kcache *kc = kcache; kc < &kcache[NCPU]; kc++){
+    acquire(&kc->lock);
+    used += kc->used_pages;
+    release(&kc->lock);
+  }
+  acquire(&kzero.lock);
+  used -= kzero.n;
+  release(&kzero.lock);
+  acquire(&buddy.lock);
+  used += buddy.used_pages;
+  release(&buddy.lock);
+  return used;
+}
+
+// Return this cpu's cache, locked.
+static struct kcache *
+kcache_lock(void)
+{
+  struct kcache *kc;
+
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  pop_off();
+  return kc;
+}
+
+// Unlink up to n pages from *list onto *to.
+static int
+take(struct run **list, struct run **to, int n)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < n && (r = *list) != 0; i++){
+    *list = r->next;
+    r->next = *to;
+    *to = r;
+  }
+  return i;
+}
+
+// Refill an empty cpu cache with a batch from kmem or,
+// when kmem is empty, with half of another cpu's cache.
+// Called and returns with kc->lock held, but drops it
+// while stealing so two cpus can't wait on each other.
+static void
+kcache_refill(struct kcache *kc)
+{
+  struct kcache *o;
+  struct run *stolen = 0;
+  int n;
+
   acquire(&kmem.lock);
-  uint64 used = kmem.used_pages;
+  kc->n += take(&kmem.freelist, &kc->freelist, KBATCH);
   release(&kmem.lock);
-  return used;
+  if(kc->freelist)
+    return;
+
+  release(&kc->lock);
+  n = 0;
+  for(o = kcache; o < &kcache[NCPU] && n == 0; o++){
+    if(o == kc)
+      continue;
+    acquire(&o->lock);
+    n = take(&o->freelist, &stolen, (o->n + 1) / 2);
+    o->n -= n;
+    release(&o->lock);
+  }
+  acquire(&kc->lock);
+  kc->n += take(&stolen, &kc->freelist, n);
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().  The page goes back to the free
+// list only when its last reference is dropped.
 void
 kfree(void *pa)
 {
   struct run *r;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < membase || (uint64)pa >= PHYSTOP)
     panic("kfree");
+  if((char*)pa >= buddy.base && (char*)pa < buddy.end){
+    kfree_order(pa, 0);
+    return;
+  }
 
   int ref;
   if ((ref = decrement((uint64)pa)) > 1)
     return;
+  if (ref != 1)
+    panic("kfree: ref");
 
+#ifdef DEBUG_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  kmem.used_pages -= (ref? 1 : 0);
-  release(&kmem.lock);
+  struct kcache *kc = kcache_lock();
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->used_pages--;
+  if(++kc->n > KCACHE){
+    acquire(&kmem.lock);
+    kc->n -= take(&kc->freelist, &kmem.freelist, KBATCH);
+    release(&kmem.lock);
+  }
+  release(&kc->lock);
+}
+
+// Take a page from this cpu's cache, refilling it if empty.
+static void *
+kcache_alloc(void)
+{
+  struct run *r;
+
+  struct kcache *kc = kcache_lock();
+  if(kc->freelist == 0)
+    kcache_refill(kc);
+  r = kc->freelist;
+  if(r)
+    kc->freelist = r->next,
+    kc->n--,
+    kc->used_pages++;
+  release(&kc->lock);
+
+  if(r)
+    pa2frame((uint64)r)->ref = 1;
+  return (void*)r;
+}
+
+static void *
+kzero_take(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r)
+    kzero.freelist = r->next,
+    kzero.n--;
+  release(&kzero.lock);
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -118,19 +318,203 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  void *pa;
+
+  if((pa = kcache_alloc()) == 0 && (pa = kzero_take()) == 0)
+    return kalloc_order(0);
+#ifdef DEBUG_JUNK
+  memset(pa, 5, PGSIZE); // fill with junk
+#endif
+  return pa;
+}
+
+// Allocate one zeroed page, preferably from the pool
+// that idle cpus fill.  Returns 0 if out of memory.
+void *
+kzalloc(void)
+{
+  void *pa;
+
+  if((pa = kzero_take()) != 0)
+    return pa;
+  if((pa = kcache_alloc()) != 0 || (pa = kalloc_order(0)) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Called by an idle cpu: zero up to KZBATCH free pages
+// into the kzalloc() pool.  Returns how many it zeroed,
+// 0 once the pool is full or memory has run out.
+int
+kzero_fill(void)
 {
   struct run *r;
+  int i;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next,
-    kmem.used_pages++;
-  release(&kmem.lock);
+  for(i = 0; i < KZBATCH; i++){
+    if(__atomic_load_n(&kzero.n, __ATOMIC_RELAXED) >= KZPOOL)
+      break;
+    if((r = kcache_alloc()) == 0)
+      break;
+    memset(r, 0, PGSIZE);
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.n++;
+    release(&kzero.lock);
+  }
+  return i;
+}
+
+static void
+bpush(char *pa, int order)
+{
+  struct bnode *b = (struct bnode*)pa, *h = &buddy.free[order];
+  struct frame *f = pa2frame((uint64)pa);
+
+  f->order = order;
+  f->free = 1;
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.nfree[order]++;
+}
+
+static void
+bunlink(char *pa, int order)
+{
+  struct bnode *b = (struct bnode*)pa;
+
+  pa2frame((uint64)pa)->free = 0;
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree[order]--;
+}
 
-  if(r) {
-    memset((char*)r, 5, PGSIZE); // fill with junk
-    increment((uint64)r);
+// Set aside BUDDYMEM bytes, aligned to the largest
+// block, at the start of the managed memory.
+void
+buddyinit(void)
+{
+  uint64 blk = (uint64)PGSIZE << KMAXORDER;
+  char *p;
+
+  initlock(&buddy.lock, "buddy");
+  for(int i = 0; i <= KMAXORDER; i++)
+    buddy.free[i].next = buddy.free[i].prev = &buddy.free[i];
+  buddy.base = (char*)(((uint64)membase + blk - 1) & ~(blk - 1));
+  buddy.end = buddy.base + BUDDYMEM / blk * blk;
+  if(buddy.end > (char*)PHYSTOP)
+    panic("buddyinit");
+  for(p = buddy.base; p < buddy.end; p += blk)
+    bpush(p, KMAXORDER);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size.  Returns 0 if no such block is free.
+void *
+kalloc_order(int order)
+{
+  char *pa;
+  int o;
+
+  if(order < 0 || order > KMAXORDER)
+    return 0;
+
+  acquire(&buddy.lock);
+  for(o = order; o <= KMAXORDER && buddy.nfree[o] == 0; o++)
+    ;
+  if(o > KMAXORDER){
+    release(&buddy.lock);
+    return 0;
   }
-  return (void*)r;
+  pa = (char*)buddy.free[o].next;
+  bunlink(pa, o);
+  // give back the upper halves until the block fits.
+  while(o > order){
+    o--;
+    bpush(pa + ((uint64)PGSIZE << o), o);
+  }
+  pa2frame((uint64)pa)->order = order;
+  buddy.used_pages += 1L << order;
+  release(&buddy.lock);
+
+  pa2frame((uint64)pa)->ref = 1;
+#ifdef DEBUG_JUNK
+  memset(pa, 5, (uint64)PGSIZE << order);
+#endif
+  return pa;
+}
+
+// Free a block from kalloc_order(order), merging it with
+// its buddy as long as that is free too.
+void
+kfree_order(void *pa, int order)
+{
+  uint64 size = (uint64)PGSIZE << order;
+  char *p = pa, *b;
+  struct frame *f;
+
+  if(order < 0 || order > KMAXORDER || p < buddy.base || p >= buddy.end ||
+     (p - buddy.base) % size != 0 || pa2frame((uint64)p)->order != order)
+    panic("kfree_order");
+
+  int ref;
+  if((ref = decrement((uint64)p)) > 1)
+    return;
+  if(ref != 1)
+    panic("kfree_order: ref");
+
+#ifdef DEBUG_JUNK
+  memset(p, 1, size);
+#endif
+
+  acquire(&buddy.lock);
+  buddy.used_pages -= 1L << order;
+  while(order < KMAXORDER){
+    b = buddy.base + ((p - buddy.base) ^ ((uint64)PGSIZE << order));
+    f = pa2frame((uint64)b);
+    if(!f->free || f->order != order)
+      break;
+    bunlink(b, order);
+    if(b < p)
+      p = b;
+    order++;
+  }
+  bpush(p, order);
+  release(&buddy.lock);
+}
+
+// Break a block from kalloc_order(order), which the caller
+// holds the only reference to, into 2^order single pages
+// that can then be freed one at a time.
+void
+ksplit(void *pa, int order)
+{
+  char *p = pa;
+  struct frame *f = pa2frame((uint64)p);
+
+  if(order < 0 || order > KMAXORDER || p < buddy.base || p >= buddy.end ||
+     f->order != order || f->ref != 1)
+    panic("ksplit");
+
+  acquire(&buddy.lock);
+  for(uint64 i = 0; i < (1L << order); i++){
+    f = pa2frame((uint64)p + i*PGSIZE);
+    f->order = 0;
+    f->ref = 1;
+  }
+  release(&buddy.lock);
+}
+
+// Number of free buddy blocks of each order.
+void
+buddy_stats(int *nfree)
+{
+  acquire(&buddy.lock);
+  for(int i = 0; i <= KMAXORDER; i++)
+    nfree[i] = buddy.nfree[i];
+  release(&buddy.lock);
 }
@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only freezes a transaction when there
+// are no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,7 +19,16 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the commit thread has made room.
+//
+// Commits are done by a kernel thread, logd, rather than by the
+// last end_op(). It gathers the operations of up to COMMITTICKS
+// ticks into one transaction, committing sooner if the log fills
+// up or log_sync() asks for it. To commit, it briefly holds off
+// new operations while it copies the transaction's blocks into
+// its own frozen buffers; after that, new operations go ahead
+// into the next transaction while logd writes the frozen copies
+// to the log and then to their home locations.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,58 +37,121 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, but the blocks of one are
+// handed to the disk as a single batch.
+//
+// mkfs chooses the size of the log (sb.nlog): at least LOGSIZE
+// data blocks, and the header block bounds it to MAXLOG. Each
+// operation may write log.opblocks blocks, a third of the log
+// and so at least MAXOPBLOCKS; larger logs let filewrite() do
+// more per transaction.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[];  // MAXLOG at most, to fit in one block
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // data blocks the log can hold.
+  int opblocks;    // blocks reserved for each operation.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // logd is freezing the transaction, please wait.
+  int waiting;     // begin_op()s waiting for log space.
+  int force;       // log_sync() wants a commit now.
+  uint first;      // ticks when the transaction got its first block.
+  int seq;         // transactions frozen so far.
+  int done;        // transactions whose header is on disk.
   int dev;
-  struct logheader lh;
+  struct logheader *lh;
 };
 struct log log;
 
+// owned by logd: the transaction being written, frozen copies
+// of its blocks, and the cache blocks they were copied from.
+// each array has log.cap entries.
+static struct logheader *clh;
+static struct buf **frozen;
+static struct buf **pinned;
+static struct buf **bs;  // scratch, for bwritev()
+
 static void recover_from_log(void);
-static void commit();
+static void logd(void);
+
+// Get a zeroed page for one of the log's arrays.
+static void *
+logpage(void)
+{
+  void *pg;
+
+  if((pg = kzalloc()) == 0)
+    panic("initlog: kalloc");
+  return pg;
+}
+
+// Carve the n frozen bufs out of kalloc() pages.
+static void
+frozen_alloc(int n)
+{
+  char *pg = 0;
+  int i, left = 0;
+
+  frozen = logpage();
+  for (i = 0; i < n; i++) {
+    if (left < sizeof(struct buf)) {
+      pg = logpage();
+      left = PGSIZE;
+    }
+    frozen[i] = (struct buf *) pg;
+    pg += sizeof(struct buf);
+    left -= sizeof(struct buf);
+  }
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  // an operation may need MAXOPBLOCKS, and begin_op() would
+  // wait forever for more room than the log has.
+  if (sb->nlog - 1 < LOGSIZE || sb->nlog - 1 > MAXLOG)
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.cap = sb->nlog - 1;
+  log.opblocks = log.cap / 3;
   log.dev = dev;
+  log.lh = logpage();
+  clh = logpage();
+  pinned = logpage();
+  bs = logpage();
+  frozen_alloc(log.cap);
   recover_from_log();
+  kthread("logd", logd);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// Only used for recovery, before logd starts.
 static void
-install_trans(int recovering)
+install_trans(void)
 {
+  struct buf **dbuf = bs;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
+  for (tail = 0; tail < log.lh->n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+    dbuf[tail] = bread(log.dev, log.lh->block[tail]); // read dst
+    memmove(dbuf[tail]->data, lbuf->data, BSIZE);  // copy block to dst
     brelse(lbuf);
-    brelse(dbuf);
   }
+  bwritev(dbuf, log.lh->n);  // write dsts to disk
+  for (tail = 0; tail < log.lh->n; tail++)
+    brelse(dbuf[tail]);
 }
 
 // Read the log header from disk into the in-memory log header
@@ -89,25 +161,27 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  if (lh->n < 0 || lh->n > log.cap)
+    panic("read_head: bad header");
+  log.lh->n = lh->n;
+  for (i = 0; i < log.lh->n; i++) {
+    log.lh->block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write log header h to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *h)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = h->n;
+  for (i = 0; i < h->n; i++) {
+    hb->block[i] = h->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -117,9 +191,9 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  install_trans(); // if committed, copy from log to disk
+  log.lh->n = 0;
+  write_head(log.lh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -130,9 +204,12 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh->n + (log.outstanding+1)*log.opblocks > log.cap){
+      // this op might exhaust log space; get logd to commit.
+      log.waiting++;
+      wakeup(&ticks);
       sleep(&log, &log.lock);
+      log.waiting--;
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -142,69 +219,150 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  // logd may be waiting for the last op to finish, and
+  // begin_op() may be waiting for log space, since
+  // decrementing log.outstanding has decreased the
+  // amount of reserved space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Wait until every operation that has ended so far is
+// committed to the on-disk log.
+void
+log_sync(void)
+{
+  int target;
+
+  acquire(&log.lock);
+  if(log.lh->n > 0){
+    target = log.seq + 1;
+    log.force = 1;
+    wakeup(&ticks);
+  } else
+    target = log.seq;
+  while(log.done < target)
+    sleep(&log.done, &log.lock);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
+// Make the current transaction logd's and start a new, empty
+// one. Called with log.lock held, so that log_sync() sees the
+// header emptied and log.seq advanced together.
+static void
+swap_head(void)
+{
+  int i;
+
+  clh->n = log.lh->n;
+  for (i = 0; i < clh->n; i++)
+    clh->block[i] = log.lh->block[i];
+  log.lh->n = 0;
+  log.seq++;
 }
 
-// Copy modified blocks from cache to log.
+// Copy the transaction's blocks into the frozen buffers.
+// Called with log.committing set and no operations
+// outstanding, so nothing changes the blocks while they
+// are copied.
 static void
-write_log(void)
+freeze(void)
 {
-  int tail;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (i = 0; i < clh->n; i++) {
+    // pinned by log_write(), so still cached.
+    struct buf *from = bread(log.dev, clh->block[i]);
+    memmove(frozen[i]->data, from->data, BSIZE);
+    pinned[i] = from;
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the frozen copies to the log, and then home.
 static void
-commit()
-{
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+commit(void)
+{
+  int i;
+
+  for (i = 0; i < clh->n; i++) {
+    frozen[i]->blockno = log.start+i+1;
+    bs[i] = frozen[i];
+  }
+  bwritev(bs, clh->n);  // Write the frozen blocks to the log
+  write_head(clh);      // Write header to disk -- the real commit
+
+  acquire(&log.lock);
+  log.done = log.seq;
+  wakeup(&log.done);
+  release(&log.lock);
+
+  for (i = 0; i < clh->n; i++) {
+    frozen[i]->blockno = clh->block[i];
+    bs[i] = frozen[i];
+  }
+  bwritev(bs, clh->n);  // Now install writes to home locations
+  for (i = 0; i < clh->n; i++)
+    bunpin(pinned[i]);  // the cache may evict them now
+  clh->n = 0;
+  write_head(clh);      // Erase the transaction from the log
+}
+
+// The commit thread.
+static void
+logd(void)
+{
+  int i;
+
+  for (i = 0; i < log.cap; i++) {
+    initsleeplock(&frozen[i]->lock, "frozen");
+    acquiresleep(&frozen[i]->lock);  // for bwritev()
+    frozen[i]->dev = log.dev;
+  }
+
+  acquire(&log.lock);
+  for(;;){
+    if(log.lh->n == 0){
+      sleep(&log.first, &log.lock);  // until log_write() starts one
+      continue;
+    }
+    // logd waits on ticks while a transaction's window is
+    // open, so begin_op() and log_sync() poke it there.
+    if(!log.force && log.waiting == 0 && ticks - log.first < COMMITTICKS){
+      sleep(&ticks, &log.lock);
+      continue;
+    }
+
+    // hold off new operations, and wait for the
+    // running ones to finish.
+    log.committing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    log.force = 0;
+    swap_head();
+    release(&log.lock);
+
+    freeze();
+
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit();
+
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logd will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,20 +375,30 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh->n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < log.lh->n; i++) {
+    if (log.lh->block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  log.lh->block[i] = b->blockno;
+  if (i == log.lh->n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    if (log.lh->n == 0) {
+      log.first = ticks;
+      wakeup(&log.first);  // logd starts the commit window
+    }
+    log.lh->n++;
   }
   release(&log.lock);
 }
 
+// Most blocks one FS operation may write.
+int
+log_opblocks(void)
+{
+  return log.opblocks;
+}
@@ -6,9 +6,20 @@
 #define NDEV         10  // maximum major device number
 #define ROOTDEV      1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  10  // max # of blocks any FS op writes, at least
+#define LOGSIZE      (MAXOPBLOCKS*3)  // least data blocks in the log, see mkfs -l
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define RABLOCKS     8  // blocks of sequential read-ahead per file
+#define BUFMEMDIV    8  // block cache may grow to 1/BUFMEMDIV of free memory
+#define COMMITTICKS  2  // most ticks a logged change waits to be committed
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define MAXREPORT    10 // max report buffer size
+#define NMLFQ        3  // number of MLFQ priority levels
+#define BOOSTTICKS   100  // default ticks between MLFQ priority boosts
+#define NVMA         16  // mapped regions per process
+#define NPCACHE      128  // pages of file data in the page cache
+#define NKCACHE      8  // maximum number of slab caches
+#define PIPEORDER    0  // a pipe buffer is 2^PIPEORDER pages
+#define KMAXORDER    10  // largest kalloc_order() block is 2^KMAXORDER pages
+#define BUDDYMEM     (8*1024*1024)  // bytes set aside for the buddy allocator
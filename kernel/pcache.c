@@ -0,0 +1,225 @@
+// Page cache.
+//
+// Whole pages of file data, for mapping into user address
+// spaces.  exec maps program text straight out of the
+// cache, so every process running the same binary shares
+// the same physical pages.  The cache holds a reference to
+// each of its pages; a page stays valid for the processes
+// that map it after it is evicted or invalidated.
+//
+// MAP_SHARED mappings pin their pages: a pinned page is
+// never evicted, and when its file is written the new
+// bytes are copied into it rather than the page dropped,
+// so every shared mapping keeps seeing the file's current
+// contents without losing its own unwritten stores.
+//
+// Interface:
+// * pcache_get returns a page of a file, reading it if needed.
+// * pcache_write updates a file's pages after writei().
+// * pcache_inval forgets a file's pages after it is truncated.
+// The caller must hold the inode's lock for these.
+// * pcache_pin/pcache_unpin add and drop a shared mapping's
+//   pin on a page pcache_get returned.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+struct pcent {
+  uint dev;
+  uint inum;
+  uint off;     // page-aligned offset in the file
+  uint64 pa;    // 0 if the entry is free
+  uint used;    // pcache.clock at the last hit, for eviction
+  int pins;     // MAP_SHARED mappings of the page
+};
+
+struct {
+  struct spinlock lock;
+  struct pcent ent[NPCACHE];
+  uint clock;
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Return the physical page holding bytes [off, off+PGSIZE)
+// of ip, with a reference for the caller, and pinned if pin
+// is set, or 0 on failure.  off must be page-aligned and
+// inside the file; the part of the page past the end of
+// the file reads as zeroes.
+uint64
+pcache_get(struct inode *ip, uint off, int pin)
+{
+  struct pcent *e, *victim;
+  char *mem;
+
+  acquire(&pcache.lock);
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->pa && e->dev == ip->dev && e->inum == ip->inum && e->off == off){
+      e->used = ++pcache.clock;
+      if(pin)
+        e->pins++;
+      increment(e->pa);
+      release(&pcache.lock);
+      return e->pa;
+    }
+  }
+  release(&pcache.lock);
+
+  // Not cached.  Holding ip->lock keeps anyone else from
+  // adding this page meanwhile.
+  if((mem = kzalloc()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)mem, off, PGSIZE) <= 0){
+    kfree(mem);
+    return 0;
+  }
+
+  // Recycle a free or the least recently used unpinned entry.
+  acquire(&pcache.lock);
+  victim = 0;
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->pa == 0){
+      victim = e;
+      break;
+    }
+    if(e->pins == 0 && (victim == 0 || e->used < victim->used))
+      victim = e;
+  }
+  if(victim == 0){
+    release(&pcache.lock);
+    kfree(mem);
+    return 0;
+  }
+  if(victim->pa)
+    kfree((void*)victim->pa);
+  victim->dev = ip->dev;
+  victim->inum = ip->inum;
+  victim->off = off;
+  victim->pa = (uint64)mem;
+  victim->used = ++pcache.clock;
+  victim->pins = pin != 0;
+  increment((uint64)mem);
+  release(&pcache.lock);
+  return (uint64)mem;
+}
+
+// Update ip's cached pages after writei() copied the n
+// bytes at src to [off, off+n).  Only pages in that range
+// change: unpinned ones are dropped, and the written bytes
+// are copied into pinned ones, so stores made through a
+// shared mapping to the rest of such a page survive.
+void
+pcache_write(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  struct pcent *e;
+  uint64 pa;
+  uint a, b;
+
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    acquire(&pcache.lock);
+    if(e->pa == 0 || e->dev != ip->dev || e->inum != ip->inum ||
+       e->off >= off + n || e->off + PGSIZE <= off){
+      release(&pcache.lock);
+      continue;
+    }
+    if(e->pins == 0){
+      kfree((void*)e->pa);
+      e->pa = 0;
+      release(&pcache.lock);
+      continue;
+    }
+    // keep the page while copying, in case the last
+    // mapping goes away and the entry is recycled.
+    pa = e->pa;
+    a = e->off > off ? e->off : off;
+    b = e->off + PGSIZE < off + n ? e->off + PGSIZE : off + n;
+    pa += a - e->off;
+    increment(e->pa);
+    release(&pcache.lock);
+
+    either_copyin((void*)pa, user_src, src + (a - off), b - a);
+    kfree((void*)PGROUNDDOWN(pa));
+  }
+}
+
+// Drop the cached pages of ip, which was truncated.
+// Pinned pages are re-read in place instead.
+void
+pcache_inval(struct inode *ip)
+{
+  struct pcent *e;
+  uint64 pa;
+  uint off;
+  int n;
+
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    acquire(&pcache.lock);
+    if(e->pa == 0 || e->dev != ip->dev || e->inum != ip->inum){
+      release(&pcache.lock);
+      continue;
+    }
+    if(e->pins == 0){
+      kfree((void*)e->pa);
+      e->pa = 0;
+      release(&pcache.lock);
+      continue;
+    }
+    // keep the page while reading, in case the last
+    // mapping goes away and the entry is recycled.
+    pa = e->pa;
+    off = e->off;
+    increment(pa);
+    release(&pcache.lock);
+
+    if((n = readi(ip, 0, pa, off, PGSIZE)) < 0)
+      n = 0;
+    memset((char*)pa + n, 0, PGSIZE - n);
+    kfree((void*)pa);
+  }
+}
+
+// Find the entry holding page pa.  Called with pcache.lock held.
+static struct pcent *
+pcache_find(uint64 pa)
+{
+  struct pcent *e;
+
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++)
+    if(e->pa == pa)
+      return e;
+  return 0;
+}
+
+void
+pcache_pin(uint64 pa)
+{
+  struct pcent *e;
+
+  acquire(&pcache.lock);
+  if((e = pcache_find(pa)) == 0)
+    panic("pcache_pin");
+  e->pins++;
+  release(&pcache.lock);
+}
+
+void
+pcache_unpin(uint64 pa)
+{
+  struct pcent *e;
+
+  acquire(&pcache.lock);
+  if((e = pcache_find(pa)) == 0 || e->pins <= 0)
+    panic("pcache_unpin");
+  e->pins--;
+  release(&pcache.lock);
+}
@@ -8,17 +8,48 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#define PIPESIZE (PGSIZE << PIPEORDER)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // ring of PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rbusy;      // a splice is draining the ring
+  int wbusy;      // a splice is filling the ring
 };
 
+struct kmem_cache *pipecache;
+
+// single-page rings come from the general allocator;
+// larger ones need a contiguous buddy block.
+static char *
+pipebuf_alloc(void)
+{
+  if(PIPEORDER == 0)
+    return kalloc();
+  return kalloc_order(PIPEORDER);
+}
+
+static void
+pipebuf_free(char *buf)
+{
+  if(PIPEORDER == 0)
+    kfree(buf);
+  else
+    kfree_order(buf, PIPEORDER);
+}
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe), 0);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +59,16 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
+    goto bad;
+  if((pi->data = pipebuf_alloc()) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->rbusy = 0;
+  pi->wbusy = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -46,8 +81,11 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    if(pi->data)
+      pipebuf_free(pi->data);
+    kmem_cache_free(pipecache, pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,15 +106,36 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipebuf_free(pi->data);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// wait until there is something to read, or no writers
+// are left, and no splice is draining the ring.
+static int
+pipewaitread(struct pipe *pi, struct proc *pr)
+{
+  while(pi->rbusy || (pi->nread == pi->nwrite && pi->writeopen)){  //DOC: pipe-empty
+    if(killed(pr))
+      return -1;
+    if(pi->rbusy)
+      sleep(&pi->rbusy, &pi->lock);
+    else
+      sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+  }
+  return 0;
+}
+
+// data moves in contiguous runs of the ring, one copyin/copyout
+// per run. a reader only sleeps on an empty pipe and a writer only
+// on a full one, so wakeups are issued just when a run takes the
+// pipe across one of those thresholds.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m, off;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,18 +144,24 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
+    if(pi->wbusy){
+      sleep(&pi->wbusy, &pi->lock);
+      continue;
+    }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      continue;
     }
+    off = pi->nwrite % PIPESIZE;
+    m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+    m = min(m, PIPESIZE - off);
+    if(copyin(pr->pagetable, pi->data + off, addr + i, m) == -1)
+      break;
+    if(pi->nwrite == pi->nread)
+      wakeup(&pi->nread);  // was empty
+    pi->nwrite += m;
+    i += m;
   }
-  wakeup(&pi->nread);
   release(&pi->lock);
 
   return i;
@@ -105,26 +170,124 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m, off;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(killed(pr)){
-      release(&pi->lock);
-      return -1;
+  if(pipewaitread(pi, pr) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    off = pi->nread % PIPESIZE;
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - off);
+    if(copyout(pr->pagetable, addr + i, pi->data + off, m) == -1)
+      break;
+    if(pi->nwrite == pi->nread + PIPESIZE)
+      wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    pi->nread += m;
+  }
+  release(&pi->lock);
+  return i;
+}
+
+// splice: move data between the ring and the inode behind
+// file f without a trip through user space. readi/writei
+// sleep, so the copy runs with the pipe lock dropped; wbusy
+// and rbusy keep other writers and readers off the ring
+// until the run is accounted for.
+
+// Fill the pipe with up to n bytes from f. Returns -1 only
+// if nothing was moved; f's offset has advanced past any
+// bytes that were.
+int
+pipesplicein(struct pipe *pi, struct file *f, int n)
+{
+  int i = 0, m, off, r;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->wbusy)
+    sleep(&pi->wbusy, &pi->lock);
+  pi->wbusy = 1;
+  while(i < n){
+    if(pi->readopen == 0 || killed(pr)){
+      if(i == 0)
+        i = -1;
+      break;
+    }
+    if(pi->nwrite == pi->nread + PIPESIZE){
+      sleep(&pi->nwrite, &pi->lock);
+      continue;
     }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    off = pi->nwrite % PIPESIZE;
+    m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+    m = min(m, PIPESIZE - off);
+    release(&pi->lock);
+
+    ilock(f->ip);
+    if((r = readi(f->ip, 0, (uint64)pi->data + off, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+
+    acquire(&pi->lock);
+    if(r <= 0)
+      break;
+    if(pi->nwrite == pi->nread)
+      wakeup(&pi->nread);
+    pi->nwrite += r;
+    i += r;
+    if(r < m)
+      break;  // end of file
+  }
+  pi->wbusy = 0;
+  wakeup(&pi->wbusy);
+  release(&pi->lock);
+  return i;
+}
+
+// Drain up to n bytes of the pipe into f.
+int
+pipespliceout(struct pipe *pi, struct file *f, int n)
+{
+  int i, m, off, r;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  if(pipewaitread(pi, pr) < 0){
+    release(&pi->lock);
+    return -1;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  pi->rbusy = 1;
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += r){
+    off = pi->nread % PIPESIZE;
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - off);
+    m = min(m, MAXWRITE);
+    release(&pi->lock);
+
+    begin_op();
+    ilock(f->ip);
+    if((r = writei(f->ip, 0, (uint64)pi->data + off, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    end_op();
+
+    acquire(&pi->lock);
+    if(r <= 0)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    if(pi->nwrite == pi->nread + PIPESIZE)
+      wakeup(&pi->nwrite);
+    pi->nread += r;
+    if(r != m){
+      // error from writei
+      i += r;
       break;
+    }
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pi->rbusy = 0;
+  wakeup(&pi->rbusy);
   release(&pi->lock);
   return i;
 }
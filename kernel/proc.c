@@ -15,8 +15,18 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// MLFQ tunables; see mlfq_set().
+struct {
+  struct spinlock lock;
+  struct mlfq_conf conf;
+} mlfq = {
+  .conf = { .quantum = {5, 10, 20}, .boost = BOOSTTICKS },
+};
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static int runq_pick(void);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -48,9 +58,13 @@ void
 procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  initlock(&mlfq.lock, "mlfq");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+      initlock(&c->rq.lock, "runq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -131,6 +145,10 @@ found:
   release(&tickslock);
   p->rtime = p->ticks_remain = 0;
   p->priority = 1;
+  p->nmigrate = 0;
+  p->cow_copies = p->cow_reuse = 0;
+  p->tlb_pa = 0;
+  p->kfn = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -257,7 +275,40 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  p->cpu = runq_pick();
+  setrunnable(p);
+
+  release(&p->lock);
+}
+
+// A kernel thread's first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread that runs fn(), which must not
+// return. It is a process that never enters user space.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  p->cpu = runq_pick();
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -272,11 +323,16 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // only reserve the address space; vmfault() allocates
+    // each page when it is first touched.
+    if(sz + n > vma_base(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // fails if a superpage could not be split.
+    if(uvmdealloc(p->pagetable, sz, sz + n) != sz + n)
+      return -1;
+    sz += n;
   }
   p->sz = sz;
   return 0;
@@ -315,6 +371,23 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(vma_dup(np, p) < 0){
+    release(&np->lock);
+    for(i = 0; i < NOFILE; i++)
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
+      }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    vma_free(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -327,7 +400,8 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->cpu = runq_pick();
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -368,6 +442,8 @@ exit(int status)
     }
   }
 
+  vma_free(p);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -442,101 +518,294 @@ wait(uint64 addr)
   }
 }
 
+// Choose the online cpu with the shortest run queue,
+// for a process that has no cpu of its own yet.
+// The queue lengths are only a hint, so no locks.
+static int
+runq_pick(void)
+{
+  struct cpu *c, *best = 0;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->online && (best == 0 || c->rq.len < best->rq.len))
+      best = c;
+  }
+  return best ? best - cpus : 0;
+}
+
+// Append p to the tail of its priority level
+// in cpu c's run queue.
+// Caller must hold p->lock.
+static void
+runq_push(struct cpu *c, struct proc *p)
+{
+  struct runq *rq = &c->rq;
+  int q = p->priority - 1;
+
+  acquire(&rq->lock);
+  p->rq_next = 0;
+  if(rq->tail[q])
+    rq->tail[q]->rq_next = p;
+  else
+    rq->head[q] = p;
+  rq->tail[q] = p;
+  rq->len++;
+  release(&rq->lock);
+}
+
+// Unlink and return the head of level q of rq, or 0.
+// Caller must hold rq->lock.
+static struct proc*
+runq_take(struct runq *rq, int q)
+{
+  struct proc *p;
+
+  if((p = rq->head[q]) == 0)
+    return 0;
+  rq->head[q] = p->rq_next;
+  if(rq->head[q] == 0)
+    rq->tail[q] = 0;
+  p->rq_next = 0;
+  rq->len--;
+  return p;
+}
+
+// Remove and return the first process on the highest
+// non-empty priority level of cpu c's run queue,
+// or 0 if the queue is empty.
+static struct proc*
+runq_pop(struct cpu *c)
+{
+  struct runq *rq = &c->rq;
+  struct proc *p = 0;
+
+  // peek without the lock, so that idle cpus
+  // don't keep bouncing it between caches.
+  if(*(volatile int *)&rq->len == 0)
+    return 0;
+
+  acquire(&rq->lock);
+  for(int q = 0; q < NMLFQ && p == 0; q++)
+    p = runq_take(rq, q);
+  release(&rq->lock);
+  return p;
+}
+
+// Called by cpu c when its own run queue is empty:
+// steal a process from the cpu with the longest queue.
+// Take it from the lowest non-empty priority level, where
+// the long-running jobs are, so that interactive work
+// keeps the cpu it last ran on.
+static struct proc*
+runq_steal(struct cpu *c)
+{
+  struct cpu *v, *busiest = 0;
+  struct proc *p = 0;
+
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v == c || !v->online)
+      continue;
+    if(*(volatile int *)&v->rq.len > 0 &&
+       (busiest == 0 || v->rq.len > busiest->rq.len))
+      busiest = v;
+  }
+  if(busiest == 0)
+    return 0;
+
+  acquire(&busiest->rq.lock);
+  for(int q = NMLFQ - 1; q >= 0 && p == 0; q--)
+    p = runq_take(&busiest->rq, q);
+  release(&busiest->rq.lock);
+  return p;
+}
+
+// Is a process waiting in any online cpu's run queue?
+static int
+runq_waiting(void)
+{
+  for(struct cpu *c = cpus; c < &cpus[NCPU]; c++)
+    if(c->online && *(volatile int *)&c->rq.len > 0)
+      return 1;
+  return 0;
+}
+
+// Mark p RUNNABLE and queue it on p->cpu.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = &cpus[p->cpu];
+
+  p->state = RUNNABLE;
+  runq_push(c, p);
+
+  // runq_push()'s release() orders the queue update before
+  // this read of c->idle; idle() orders them the other way,
+  // so either c sees p or c gets the IPI.
+  if(c->idle){
+    ipi(c - cpus);
+  } else if(c->proc != p){
+    // c is busy with something else: wake an idle
+    // cpu, if there is one, to steal p.
+    for(struct cpu *v = cpus; v < &cpus[NCPU]; v++){
+      if(v->online && v->idle){
+        ipi(v - cpus);
+        break;
+      }
+    }
+  }
+}
+
+// Nothing to run on cpu c: wait in wfi for an interrupt or
+// for an IPI from setrunnable().  Harts other than 0, which
+// keeps the global clock, also stop their clock ticks.
+static void
+idle(struct cpu *c)
+{
+  int tickless = c != cpus;
+  uint64 t0;
+
+  // zero pages for kzalloc() while there is nothing
+  // else to do; only sleep once the pool is full.
+  if(kzero_fill() > 0)
+    return;
+  // hand surplus disk buffers back if memory got tight.
+  if(bshrink() > 0)
+    return;
+
+  // with interrupts off, wfi still wakes on a pending one,
+  // and it is taken once scheduler() turns them back on.
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  if(!runq_waiting()){
+    t0 = timer_now();
+    if(tickless)
+      timer_stop();
+    wfi();
+    if(tickless)
+      timer_start();
+    c->idle_time += timer_now() - t0;
+  }
+  c->idle = 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take the next process off this cpu's run queue,
+//    or steal one from a busier cpu.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
 void
 scheduler(void)
 {
-  uint p1 = 0, p2 = 0, p3 = 0;
   struct proc *p;
   struct cpu *c = mycpu();
   
   c->proc = 0;
-  begin:
+  c->online = 1;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    
-    for(int i = 0; i < NPROC; i++) {
-      p = proc + ((p1 + i) % NPROC);
-      acquire(&p->lock);
-      if(p->state == RUNNABLE && p->priority == 1) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->ticks_remain = 5;
-        p->state = RUNNING;
-        p1 += i + 1;
-        c->proc = p;
-        // printf("%d is entering on 1!\n", p->pid);
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        if (p->ticks_remain == 0)
-          p->priority = 2;
-        c->proc = 0;
-        release(&p->lock);
-        goto begin;
-      }
-      release(&p->lock);
+
+    if((p = runq_pop(c)) == 0 && (p = runq_steal(c)) == 0){
+      idle(c);
+      continue;
     }
 
-    for(uint i = 0; i < NPROC; i++) {
-      p = proc + ((p2 + i) % NPROC);
-      acquire(&p->lock);
-      if(p->state == RUNNABLE && p->priority == 2) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        p->ticks_remain = 10;
-        p2 += i + 1;
-        c->proc = p;
-        // printf("%d is entering on 2!\n", p->pid);
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        if (p->ticks_remain == 0)
-          p->priority = 3;
-        c->proc = 0;
-        release(&p->lock);
-        goto begin;
-      }
-      release(&p->lock);
+    // p is off every run queue now, so no other cpu
+    // can pick it; p->lock waits out a yield() that is
+    // still on its way into sched() on the old cpu.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->ticks_remain = mlfq.conf.quantum[p->priority - 1];
+      p->state = RUNNING;
+      if(p->cpu != c - cpus)
+        p->nmigrate++;
+      p->cpu = c - cpus;
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
+  }
+}
 
-    for(uint i = 0; i < NPROC; i++) {
-      p = proc + ((p3 + i) % NPROC);
-      acquire(&p->lock);
-      if(p->state == RUNNABLE && p->priority == 3) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        p->ticks_remain = 20;
-        p3 += i + 1;
-        c->proc = p;
-        // printf("%d is entering on 3!\n", p->pid);
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        release(&p->lock);
-        goto begin;
-      }
-      release(&p->lock);
+// Move every process back to the top priority level, so
+// that CPU-bound work pushed down by a stream of short
+// jobs still gets to run.
+static void
+mlfq_boost(void)
+{
+  struct proc *p;
+  struct runq *rq;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    p->priority = 1;
+    release(&p->lock);
+  }
+
+  // splice the lower levels of each run queue, in order,
+  // onto the end of the top level.
+  for(struct cpu *c = cpus; c < &cpus[NCPU]; c++){
+    rq = &c->rq;
+    acquire(&rq->lock);
+    for(int q = 1; q < NMLFQ; q++){
+      if(rq->head[q] == 0)
+        continue;
+      if(rq->tail[0])
+        rq->tail[0]->rq_next = rq->head[q];
+      else
+        rq->head[0] = rq->head[q];
+      rq->tail[0] = rq->tail[q];
+      rq->head[q] = rq->tail[q] = 0;
     }
+    release(&rq->lock);
   }
 }
 
+// Called by clockintr() on every tick of the global clock.
+void
+mlfq_tick(uint t)
+{
+  uint boost = mlfq.conf.boost;
+
+  if(boost && t % boost == 0)
+    mlfq_boost();
+}
+
+void
+mlfq_get(struct mlfq_conf *conf)
+{
+  acquire(&mlfq.lock);
+  *conf = mlfq.conf;
+  release(&mlfq.lock);
+}
+
+// Install new time slices and boost period.
+// Returns 0, or -1 if a time slice is zero.
+int
+mlfq_set(struct mlfq_conf *conf)
+{
+  for(int q = 0; q < NMLFQ; q++)
+    if(conf->quantum[q] == 0)
+      return -1;
+
+  acquire(&mlfq.lock);
+  mlfq.conf = *conf;
+  release(&mlfq.lock);
+  return 0;
+}
+
 // Switch to scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
@@ -570,7 +839,10 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  // a process that used up its time slice drops a level.
+  if(p->ticks_remain == 0 && p->priority < NMLFQ)
+    p->priority++;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -638,7 +910,7 @@ wakeup(void *chan)
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
     }
@@ -659,7 +931,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -743,7 +1015,8 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s cpu %d (%d moves) cow %d/%d", p->pid, state, p->name, p->cpu, p->nmigrate,
+           p->cow_copies, p->cow_reuse);
     printf("\n");
   }
 }
@@ -759,6 +1032,8 @@ fill_pinfo(struct proc_info *pi, struct proc *p)
   pi->ctime = p->ctime;
   pi->rtime = p->rtime;
   pi->sz = p->sz;
+  pi->cow_copies = p->cow_copies;
+  pi->cow_reuse = p->cow_reuse;
   
   acquire(&wait_lock);
   pi->ppid = 0;
@@ -774,6 +1049,12 @@ fill_top(struct top *t)
   t->running_process = t->sleeping_process = t->total_process = 0;
   t->total_pages = get_total_pages();
   t->used_pages = get_used_pages();
+  buddy_stats(t->buddy_free);
+  t->nslab = slab_stats(t->slab);
+  t->ncpu = 0;
+  for(struct cpu *c = cpus; c < &cpus[NCPU]; c++)
+    if(c->online)
+      t->idle_time[t->ncpu++] = c->idle_time;
 
   for(p = proc; p < &proc[NPROC]; p++) {
     acquire(&p->lock);
@@ -18,12 +18,25 @@ struct context {
   uint64 s11;
 };
 
+// Per-CPU MLFQ run queue: one FIFO of RUNNABLE processes
+// per priority level, linked through proc.rq_next.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NMLFQ];
+  struct proc *tail[NMLFQ];
+  int len;                    // Processes on all levels.
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int online;                 // Has this cpu entered scheduler()?
+  int idle;                   // Is this cpu waiting in wfi?
+  uint64 idle_time;           // CLINT cycles spent in wfi.
+  struct runq rq;             // Processes waiting to run on this cpu.
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +92,20 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a process's address space whose pages are
+// filled in on first touch, from a file and then zeroes:
+// an exec'd program segment below p->sz, or an mmap()
+// region, placed downwards from TRAPFRAME.
+struct vma {
+  uint64 start;         // page-aligned; end == 0 if the slot is unused
+  uint64 end;
+  int perm;             // PTE_R, PTE_W, PTE_X
+  int flags;            // MAP_SHARED or MAP_PRIVATE if from mmap()
+  struct inode *ip;     // backing file, if any; holds a reference
+  uint64 off;           // file offset of start
+  uint64 filesz;        // bytes of file data from start; zero after
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -95,6 +122,12 @@ struct proc {
   uint rtime;                  // Process running time
   int priority;                // Process priority queue number
   uint ticks_remain;           // Process ticks remaining
+  int cpu;                     // Affinity hint: cpu p last ran on, and
+                               // whose run queue p joins when RUNNABLE
+  int nmigrate;                // Times p was stolen by another cpu
+
+  // the owning cpu's rq.lock must be held when using this:
+  struct proc *rq_next;        // Next process in the same run queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -107,7 +140,14 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged regions
   char name[16];               // Process name (debugging)
+  int cow_copies;              // COW faults that copied the page
+  int cow_reuse;               // COW faults on a page p alone still mapped
+  uint64 tlb_va;               // Last user page copyin/copyout translated,
+  uint64 tlb_pa;               //   its physical address (0 if none),
+  int tlb_write;               //   and whether it may be written
+  void (*kfn)(void);           // Body of a kernel thread, else 0
 };
 
 struct proc_info {
@@ -118,6 +158,18 @@ struct proc_info {
   uint ctime;
   uint rtime;
   uint64 sz;
+  int cow_copies;
+  int cow_reuse;
+};
+
+// Usage of one slab cache, for top.
+struct slab_info {
+  char name[16];
+  uint size;    // object size
+  uint inuse;   // objects allocated
+  uint peak;    // most objects ever allocated at once
+  uint total;   // objects that fit in the cache's pages
+  uint nslab;   // pages
 };
 
 struct top {
@@ -128,6 +180,17 @@ struct top {
   int sleeping_process;
   uint64 total_pages;
   uint64 used_pages;
+  int ncpu;
+  uint64 idle_time[NCPU];  // in CLINT cycles
+  int buddy_free[KMAXORDER+1];  // free blocks of 2^i pages
+  int nslab;
+  struct slab_info slab[NKCACHE];
+};
+
+// MLFQ tunables, read and set with the mlfq() system call.
+struct mlfq_conf {
+  uint quantum[NMLFQ];  // time slice, in ticks, at each level
+  uint boost;           // ticks between priority boosts; 0 disables
 };
 
 struct child_processes {
@@ -319,6 +319,13 @@ r_ra()
   return x;
 }
 
+// wait for an interrupt.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 // flush the TLB.
 static inline void
 sfence_vma()
@@ -338,6 +345,11 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// a level-1 leaf PTE maps a 2 MiB superpage.
+#define SUPERPGSIZE (PGSIZE << 9)
+#define SUPERORDER  9  // kalloc_order() of a superpage
+#define SUPERPGROUNDDOWN(a) (((a)) & ~(SUPERPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
@@ -352,6 +364,9 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a valid PTE with any of R, W, X is a leaf, not a page-table pointer.
+#define PTE_LEAF(pte) ((pte) & (PTE_R|PTE_W|PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
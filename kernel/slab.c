@@ -0,0 +1,209 @@
+// Slab allocator.  A cache hands out objects of one size,
+// carved from kalloc() pages ("slabs").  Each cpu keeps a
+// small magazine of free objects, so most allocations and
+// frees don't take the cache lock; the magazine is refilled
+// from, or flushed to, the slabs half of it at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "slab.h"
+#include "defs.h"
+
+// At the start of each slab page.
+struct slab {
+  struct slab *next;        // on the cache's partial list
+  void *free;               // free objects, linked through their first word
+  uint nfree;
+};
+
+#define SLABHDR  ((sizeof(struct slab) + 7) & ~7)
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NKCACHE];
+  int n;
+} kcaches;
+
+void
+slabinit(void)
+{
+  initlock(&kcaches.lock, "kcaches");
+}
+
+// Make a cache of objects of size bytes, at most limit
+// of them in use at once (0 for no limit).
+struct kmem_cache *
+kmem_cache_create(char *name, uint size, uint limit)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: size");
+
+  acquire(&kcaches.lock);
+  if(kcaches.n == NKCACHE)
+    panic("kmem_cache_create: too many");
+  c = &kcaches.cache[kcaches.n++];
+  release(&kcaches.lock);
+
+  initlock(&c->lock, "kmem_cache");
+  safestrcpy(c->name, name, sizeof(c->name));
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->limit = limit;
+  return c;
+}
+
+// Get a fresh slab page for c.  Called with c->lock held.
+static struct slab *
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->free = 0;
+  s->nfree = c->perslab;
+  for(obj = (char*)s + SLABHDR + (c->perslab - 1) * c->size;
+      obj >= (char*)s + SLABHDR; obj -= c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  s->next = c->partial;
+  c->partial = s;
+  c->nslab++;
+  c->nempty++;
+  return s;
+}
+
+// Fill magazine m up to half full from c's slabs.
+static void
+slab_refill(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&c->lock);
+  while(m->n < MAGSIZE / 2){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    if(s->nfree == c->perslab)
+      c->nempty--;
+    obj = s->free;
+    s->free = *(void**)obj;
+    if(--s->nfree == 0)
+      c->partial = s->next;
+    m->obj[m->n++] = obj;
+  }
+  release(&c->lock);
+}
+
+// Return half of magazine m to c's slabs, giving a slab
+// page back to kalloc() once it is empty, unless it is
+// the only empty one.
+static void
+slab_flush(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s, **pp;
+  void *obj;
+
+  acquire(&c->lock);
+  while(m->n > MAGSIZE / 2){
+    obj = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    if(s->nfree == 0){
+      s->next = c->partial;
+      c->partial = s;
+    }
+    *(void**)obj = s->free;
+    s->free = obj;
+    if(++s->nfree < c->perslab)
+      continue;
+    if(c->nempty == 0){
+      c->nempty++;
+      continue;
+    }
+    for(pp = &c->partial; *pp != s; pp = &(*pp)->next)
+      ;
+    *pp = s->next;
+    c->nslab--;
+    kfree(s);
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c.  Its contents are whatever
+// the last user left.  Returns 0 if out of memory or if
+// c's limit is reached.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+  int n;
+
+  n = __sync_add_and_fetch(&c->inuse, 1);
+  if(c->limit && n > c->limit){
+    __sync_fetch_and_sub(&c->inuse, 1);
+    return 0;
+  }
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    slab_refill(c, m);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+
+  if(obj == 0)
+    __sync_fetch_and_sub(&c->inuse, 1);
+  else if(n > c->peak)
+    c->peak = n;
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    slab_flush(c, m);
+  m->obj[m->n++] = obj;
+  pop_off();
+
+  __sync_fetch_and_sub(&c->inuse, 1);
+}
+
+// Copy out the usage of every cache; returns how many.
+int
+slab_stats(struct slab_info *si)
+{
+  struct kmem_cache *c;
+  int n;
+
+  acquire(&kcaches.lock);
+  n = kcaches.n;
+  release(&kcaches.lock);
+
+  for(c = kcaches.cache; c < &kcaches.cache[n]; c++, si++){
+    safestrcpy(si->name, c->name, sizeof(si->name));
+    si->size = c->size;
+    acquire(&c->lock);
+    si->nslab = c->nslab;
+    si->total = c->nslab * c->perslab;
+    release(&c->lock);
+    si->inuse = c->inuse;
+    si->peak = c->peak;
+  }
+  return n;
+}
@@ -0,0 +1,24 @@
+// Object caches, see slab.c.
+
+#define MAGSIZE 8  // objects in a per-CPU magazine
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;  // protects the slab lists and counts
+  char name[16];
+  uint size;             // object size, rounded up
+  uint perslab;          // objects in one slab page
+  uint limit;            // most objects in use at once; 0 for no limit
+  struct slab *partial;  // slabs with free objects
+  uint nslab;            // pages held
+  uint nempty;           // slabs with every object free
+  int inuse;             // objects handed out; atomic
+  int peak;              // largest inuse so far
+
+  // each cpu uses only its own, with interrupts off.
+  struct magazine mag[NCPU];
+};
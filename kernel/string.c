@@ -1,13 +1,24 @@
 #include "types.h"
 
+// memset and memmove work a 64-bit word at a time
+// wherever the alignment of the pointers allows.
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
-  }
+  uint64 w;
+
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(; n > 0 && ((uint64)cdst & 7) != 0; n--)
+    *cdst++ = c;
+  for(; n >= 8; n -= 8, cdst += 8)
+    *(uint64*)cdst = w;
+  for(; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -32,20 +43,38 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  int words;
 
   if(n == 0)
     return dst;
   
   s = src;
   d = dst;
+  words = ((uint64)s & 7) == ((uint64)d & 7);
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(words){
+      for(; n > 0 && ((uint64)d & 7) != 0; n--)
+        *--d = *--s;
+      for(; n >= 8; n -= 8){
+        d -= 8;
+        s -= 8;
+        *(uint64*)d = *(const uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      for(; n > 0 && ((uint64)d & 7) != 0; n--)
+        *d++ = *s++;
+      for(; n >= 8; n -= 8, d += 8, s += 8)
+        *(uint64*)d = *(const uint64*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
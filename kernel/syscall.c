@@ -105,6 +105,11 @@ extern uint64 sys_histry(void);
 extern uint64 sys_ttop(void);
 extern uint64 sys_chp(void);
 extern uint64 sys_rptrap(void);
+extern uint64 sys_mlfq(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_fsync(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -134,6 +139,11 @@ static uint64 (*syscalls[])(void) = {
 [SYS_ttop]    sys_ttop,
 [SYS_chp]     sys_chp,
 [SYS_rptrap]  sys_rptrap,
+[SYS_mlfq]    sys_mlfq,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_splice]  sys_splice,
+[SYS_fsync]   sys_fsync,
 };
 
 void
@@ -24,3 +24,8 @@
 #define SYS_ttop   23
 #define SYS_chp    24
 #define SYS_rptrap 25
+#define SYS_mlfq   26
+#define SYS_mmap   27
+#define SYS_munmap 28
+#define SYS_splice 29
+#define SYS_fsync  30
@@ -76,6 +76,8 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0)
+    vma_prefault(p, n);
   return fileread(f, p, n);
 }
 
@@ -90,6 +92,8 @@ sys_write(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0)
+    vma_prefault(p, n);
 
   return filewrite(f, p, n);
 }
@@ -503,3 +507,83 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off, filesz = 0;
+  int prot, flags, perm;
+  struct file *f = 0;
+  struct inode *ip = 0;
+
+  argaddr(0, &addr);  // only a hint, and ignored
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+
+  perm = 0;
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE)
+      return -1;
+    if((prot & PROT_READ) && !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    ip = f->ip;
+    ilock(ip);
+    if(off < ip->size)
+      filesz = ip->size - off;
+    iunlock(ip);
+  }
+
+  return vma_mmap(len, perm, flags & (MAP_SHARED|MAP_PRIVATE), ip, off, filesz);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return vma_munmap(addr, len);
+}
+
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+// Wait until the file system changes made so far, including
+// any to fd, are durable on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
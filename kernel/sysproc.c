@@ -32,6 +32,8 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  if(p != 0)
+    vma_prefault(p, sizeof(int));
   return wait(p);
 }
 
@@ -170,3 +172,29 @@ sys_rptrap(void)
   
   return e;
 }
+
+// get the MLFQ time slices into old and/or
+// set them from new; either may be null.
+uint64
+sys_mlfq(void)
+{
+  struct mlfq_conf *new, *old;
+  struct mlfq_conf kconf;
+
+  argaddr(0, (uint64 *)&new);
+  argaddr(1, (uint64 *)&old);
+
+  struct proc *p = myproc();
+  if(old) {
+    mlfq_get(&kconf);
+    if(copyout(p->pagetable, (uint64)old, (char*)&kconf, sizeof(kconf)) < 0)
+      return -1;
+  }
+  if(new) {
+    if(copyin(p->pagetable, (char*)&kconf, (uint64)new, sizeof(kconf)) < 0)
+      return -1;
+    return mlfq_set(&kconf);
+  }
+
+  return 0;
+}
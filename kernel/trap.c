@@ -89,25 +89,15 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if (r_scause() == 0x000000000000000f) {
-    pte_t *pte;
-    uint64 pa, va = r_stval();
-    uint flags;
-    char *mem;
-    if((pte = walk(p->pagetable, va, 0)) == 0)
-      panic("va should exist");
-    if((*pte & PTE_V) == 0)
-      panic("page not present");
-    flags = PTE_FLAGS(*pte);
-    if ((flags & PTE_U) && !(flags & PTE_W) && (flags & PTE_COW)) {
-      pa = PTE2PA(*pte);
-      if((mem = kalloc()) == 0)
-        panic("no memory");
-      memmove(mem, (char*)pa, PGSIZE);
-      flags ^= PTE_COW ^ PTE_W;
-      *pte = PA2PTE(mem) | flags;
-      kfree((void*)pa);
-    } else {
+  } else if (r_scause() == 12 || r_scause() == 13 || r_scause() == 15) {
+    // page fault: demand-paged, lazy heap or copy-on-write page?
+    uint64 va = r_stval();
+    int write = r_scause() == 15;
+
+    // reading the page in from a file may sleep.
+    intr_on();
+
+    if(vmfault(p, va, write) < 0){
       printf("usertrap(): unexpected page fault at va=%p pid=%d\n", va, p->pid);
       setkilled(p);
     }
@@ -211,10 +201,13 @@ void
 clockintr()
 {
   if(cpuid() == 0){
+    uint t;
+
     acquire(&tickslock);
-    ticks++;
+    t = ++ticks;
     wakeup(&ticks);
     release(&tickslock);
+    mlfq_tick(t);
   }
 
   struct proc *p = myproc();
@@ -229,6 +222,41 @@ clockintr()
   }
 }
 
+// timer_scratch[] is shared with timervec; see timerinit().
+extern uint64 timer_scratch[NCPU][7];
+
+// cycles since boot, from the CLINT.
+uint64
+timer_now(void)
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
+// Stop this hart's clock ticks, for a tickless idle.
+// Interrupts must be disabled.
+void
+timer_stop(void)
+{
+  *(volatile uint64*)CLINT_MTIMECMP(cpuid()) = -1;
+}
+
+// Restart this hart's clock ticks after timer_stop().
+// Interrupts must be disabled.
+void
+timer_start(void)
+{
+  int id = cpuid();
+
+  *(volatile uint64*)CLINT_MTIMECMP(id) = timer_now() + timer_scratch[id][4];
+}
+
+// Send an inter-processor interrupt to wake hart from wfi.
+void
+ipi(int hart)
+{
+  *(volatile uint32*)CLINT_MSIP(hart) = 1;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -262,10 +290,12 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
 
-    clockintr();
+    // only a timer interrupt sets the tick flag.
+    if(__sync_lock_test_and_set(&timer_scratch[cpuid()][5], 0))
+      clockintr();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
@@ -16,6 +16,9 @@
 #include "buf.h"
 #include "virtio.h"
 
+// most bufs for adjacent blocks merged into one request.
+#define MAXSEG 8
+
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
@@ -46,13 +49,25 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[MAXSEG];  // one per data descriptor
+    int nb;
     char status;
+    char async;  // hand bufs to bdone() when done; nobody waits
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // with INDIRECT_DESC, a request takes one ring descriptor,
+  // which points at its own table of descriptors here.
+  struct virtq_desc itab[NUM][MAXSEG+2];
+
+  int indirect;      // VIRTIO_RING_F_INDIRECT_DESC negotiated
+  int event_idx;     // VIRTIO_RING_F_EVENT_IDX negotiated
+  uint16 notified;   // avail->idx as of the last notify
+  int inflight;      // requests the device has not finished
+  int waiting;       // of those, ones that someone waits for
   
   struct spinlock vdisk_lock;
   
@@ -90,9 +105,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -196,12 +211,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,30 +226,69 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// how many of the n bufs at bs hold consecutive blocks,
+// and so can go to the disk as one request.
+static int
+runlen(struct buf **bs, int n)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  int k;
 
-  acquire(&disk.vdisk_lock);
+  for(k = 1; k < n && k < MAXSEG; k++)
+    if(bs[k]->dev != bs[0]->dev || bs[k]->blockno != bs[0]->blockno + k)
+      break;
+  return k;
+}
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+// with EVENT_IDX, tell the device when to interrupt: at the
+// next completion if anyone is waiting for a request in
+// flight, since it may be theirs, but when only prefetches
+// are in flight, not until all of them are done. called with
+// vdisk_lock held.
+static void
+virtio_disk_arm(void)
+{
+  uint16 n = 0;
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  if(!disk.event_idx)
+    return;
+  if(disk.waiting == 0 && disk.inflight > 0)
+    n = disk.inflight - 1;
+  disk.avail->used_event = disk.used_idx + n;
+}
+
+// format a request for the n bufs at bs, which hold consecutive
+// blocks, and put it on the avail ring; the device hears of it
+// at the next virtio_disk_notify(). returns -1 if not enough
+// descriptors are free. called with vdisk_lock held.
+static int
+virtio_disk_queue(struct buf **bs, int n, int write, int async)
+{
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+  struct virtq_desc *d;
+  int idx[MAXSEG+2], head;
+
+  // the spec's Section 5.2 says that block operations use a
+  // descriptor for type/reserved/sector, one or more for the
+  // data, and one for a 1-byte status result. they go in the
+  // ring's descriptor table, or with INDIRECT_DESC in a table
+  // of their own, behind a single ring descriptor.
+  if(disk.indirect){
+    if((head = alloc_desc()) < 0)
+      return -1;
+    d = disk.itab[head];
+    for(int i = 0; i < n + 2; i++)
+      idx[i] = i;
+  } else {
+    if(alloc_descs(idx, n + 2) < 0)
+      return -1;
+    head = idx[0];
+    d = disk.desc;
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &disk.ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,51 +297,139 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  d[idx[0]].addr = (uint64) buf0;
+  d[idx[0]].len = sizeof(struct virtio_blk_req);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  for(int i = 0; i < n; i++){
+    d[idx[1+i]].addr = (uint64) bs[i]->data;
+    d[idx[1+i]].len = BSIZE;
+    if(write)
+      d[idx[1+i]].flags = 0; // device reads b->data
+    else
+      d[idx[1+i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[idx[1+i]].flags |= VRING_DESC_F_NEXT;
+    d[idx[1+i]].next = idx[2+i];
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+    // record struct buf for virtio_disk_intr().
+    bs[i]->disk = 1;
+    disk.info[head].b[i] = bs[i];
+  }
+  disk.info[head].nb = n;
+  disk.info[head].async = async;
+
+  disk.info[head].status = 0xff; // device writes 0 on success
+  d[idx[n+1]].addr = (uint64) &disk.info[head].status;
+  d[idx[n+1]].len = 1;
+  d[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[n+1]].next = 0;
+
+  if(disk.indirect){
+    disk.desc[head].addr = (uint64) d;
+    disk.desc[head].len = (n + 2) * sizeof(struct virtq_desc);
+    disk.desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[head].next = 0;
+  }
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[disk.avail->idx % NUM] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  disk.inflight++;
+  if(!async){
+    disk.waiting++;
+    virtio_disk_arm();
+  }
+
+  return 0;
+}
+
+// with EVENT_IDX, has idx moved past event in going from
+// old to new? (vring_need_event() in the spec.)
+static int
+need_event(uint16 event, uint16 new, uint16 old)
+{
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
+
+// tell the device to look at the avail ring, unless with
+// EVENT_IDX it has said it will look anyway.
+static void
+virtio_disk_notify(void)
+{
+  uint16 old = disk.notified;
 
   __sync_synchronize();
 
+  disk.notified = disk.avail->idx;
+  if(disk.event_idx && !need_event(disk.used->avail_event, disk.avail->idx, old))
+    return;
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// Start transfers of the n locked bufs in bs, telling the
+// device about all of them at once, and return without
+// waiting for them; see virtio_disk_wait(). runs of bufs
+// for consecutive blocks become a single request.
+void
+virtio_disk_start(struct buf **bs, int n, int write)
+{
+  int k;
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  acquire(&disk.vdisk_lock);
+  for(int i = 0; i < n; i += k){
+    k = runlen(bs + i, n - i);
+    while(virtio_disk_queue(bs + i, k, write, 0) < 0){
+      // let the device work through what is queued so far.
+      virtio_disk_notify();
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+  }
+  virtio_disk_notify();
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the device to finish with b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(&b, 1, write);
+  virtio_disk_wait(b);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Start reads of the n bufs in bs that nobody waits for:
+// as each completes, virtio_disk_intr() passes it to bdone().
+// Stops rather than wait for free descriptors; returns how
+// many reads were started.
+int
+virtio_disk_read_async(struct buf **bs, int n)
+{
+  int i, k;
 
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i += k){
+    k = runlen(bs + i, n - i);
+    if(virtio_disk_queue(bs + i, k, 0, 1) < 0)
+      break;
+  }
+  if(i > 0)
+    virtio_disk_notify();
   release(&disk.vdisk_lock);
+  return i;
 }
 
 void
@@ -309,6 +450,7 @@ virtio_disk_intr()
   // the device increments disk.used->idx when it
   // adds an entry to the used ring.
 
+again:
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
     int id = disk.used->ring[disk.used_idx % NUM].id;
@@ -316,11 +458,31 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    free_chain(id);
+    for(int i = 0; i < disk.info[id].nb; i++){
+      struct buf *b = disk.info[id].b[i];
+      disk.info[id].b[i] = 0;
+      b->disk = 0;   // disk is done with buf
+      if(disk.info[id].async)
+        bdone(b);
+      else
+        wakeup(b);
+    }
+    disk.info[id].nb = 0;
+    if(!disk.info[id].async)
+      disk.waiting--;
 
     disk.used_idx += 1;
+    disk.inflight--;
+  }
+
+  if(disk.event_idx){
+    // the device may have passed the point we ask to
+    // hear of while we set it, so look again.
+    virtio_disk_arm();
+    __sync_synchronize();
+    if(disk.used_idx != disk.used->idx)
+      goto again;
   }
 
   release(&disk.vdisk_lock);
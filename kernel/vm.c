@@ -5,6 +5,11 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -33,6 +38,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, for IPIs and to stop the timer on idle harts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -72,7 +80,8 @@ kvminithart()
 
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages.  If va is in a
+// superpage, this is the level-1 leaf PTE that maps it.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -84,22 +93,49 @@ kvminithart()
 //    0..11 -- 12 bits of byte offset within the page.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at the given level
+// (0 or 1), or a leaf PTE found above it.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
+}
+
+// Forget the current process's cached user translation
+// (see uvmaddr) before changing the PTEs of pagetable.
+static void
+tlb_flush(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    p->tlb_pa = 0;
+}
+
+// Is pte, which walk() returned for va, a superpage leaf?
+static int
+issuper(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  return pte == walklevel(pagetable, va, 0, 1);
 }
 
 // Look up a virtual address, return the physical address,
@@ -122,17 +158,77 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(issuper(pagetable, va, pte))
+    pa += PGROUNDDOWN(va) - SUPERPGROUNDDOWN(va);
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, with superpages
+// wherever va and pa are both 2 MiB aligned.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 end = PGROUNDUP(va + sz);
+  pte_t *pte;
+
+  va = PGROUNDDOWN(va);
+  pa = PGROUNDDOWN(pa);
+  while(va < end){
+    if(va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && end - va >= SUPERPGSIZE){
+      if((pte = walklevel(kpgtbl, va, 1, 1)) == 0 || (*pte & PTE_V))
+        panic("kvmmap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      va += SUPERPGSIZE;
+      pa += SUPERPGSIZE;
+    } else {
+      if(mappages(kpgtbl, va, PGSIZE, pa, perm) != 0)
+        panic("kvmmap");
+      va += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
+}
+
+// Replace the superpage covering va with 512 ordinary pages,
+// so that part of it can be unmapped or copied on write.  If
+// no one else maps the superpage its frames are reused in
+// place; otherwise this page table gets its own copies.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = walklevel(pagetable, va, 0, 1);
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+  pagetable_t pt;
+  char *mem;
+  int i;
+
+  if((pt = kzalloc()) == 0)
+    return -1;
+  tlb_flush(pagetable);
+  if(krefcnt(pa) == 1){
+    ksplit((void*)pa, SUPERORDER);
+    for(i = 0; i < 512; i++)
+      pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  } else {
+    for(i = 0; i < 512; i++){
+      if((mem = kalloc()) == 0){
+        while(--i >= 0)
+          kfree((void*)PTE2PA(pt[i]));
+        kfree(pt);
+        return -1;
+      }
+      memmove(mem, (char*)pa + i*PGSIZE, PGSIZE);
+      pt[i] = PA2PTE(mem) | flags;
+    }
+    kfree_order((void*)pa, SUPERORDER);
+  }
+  *pte = PA2PTE(pt) | PTE_V;
+  sfence_vma();
+  return 0;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -165,9 +261,12 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
+// page-aligned. Pages that were never faulted in are
+// skipped; a superpage only partly in the range is split
+// first. Optionally free the physical memory.  Returns -1,
+// with the mappings from that superpage on left in place,
+// if it could not be split.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
@@ -175,20 +274,32 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
+  tlb_flush(pagetable);
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(issuper(pagetable, a, pte)){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= va + npages*PGSIZE){
+        if(do_free)
+          kfree_order((void*)PTE2PA(*pte), SUPERORDER);
+        *pte = 0;
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      if(demote(pagetable, a) < 0)
+        return -1;
+      pte = walk(pagetable, a, 0);
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
   }
+  return 0;
 }
 
 // create an empty user page table.
@@ -197,10 +308,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -233,12 +343,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -251,7 +360,9 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// superpage straddling newsz could not be split; nothing is
+// unmapped before that split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -260,7 +371,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) < 0)
+      return oldsz;
   }
 
   return newsz;
@@ -305,15 +417,14 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
 
+  tlb_flush(old);
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // lazy page, not yet touched
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
     if (flags & PTE_W) {
@@ -321,6 +432,16 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
       *pte = PA2PTE(pa) | flags;
     }
     increment(pa);
+    if(issuper(old, i, pte)){
+      // share the whole superpage; the loop starts aligned.
+      if((npte = walklevel(new, i, 1, 1)) == 0){
+        kfree_order((void*)pa, SUPERORDER);
+        goto err;
+      }
+      *npte = PA2PTE(pa) | flags;
+      i += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
     if(mappages(new, i, PGSIZE, (uint64)pa, flags) != 0)
       goto err;
   }
@@ -331,6 +452,507 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Make the copy-on-write page at va writable, after a
+// store fault or before a copyout.  If no other page table
+// maps the page any more it is taken over in place;
+// otherwise it is copied.  Returns 0 on success, -1 if va
+// is not a COW page or memory ran out.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA || (pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  flags = PTE_FLAGS(*pte);
+  if((flags & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  tlb_flush(pagetable);
+  pa = PTE2PA(*pte);
+  flags ^= PTE_COW ^ PTE_W;
+  if(krefcnt(pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    p->cow_reuse++;
+  } else if(issuper(pagetable, va, pte)){
+    if((mem = kalloc_order(SUPERORDER)) == 0){
+      // no free superpage: copy it as ordinary pages.
+      if(demote(pagetable, va) < 0)
+        return -1;
+      return cowfault(pagetable, va);
+    }
+    memmove(mem, (char*)pa, SUPERPGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree_order((void*)pa, SUPERORDER);
+    p->cow_copies++;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+    p->cow_copies++;
+  }
+  sfence_vma();
+  return 0;
+}
+
+static struct vma *
+vma_find(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Is this cpu holding a spinlock, so that it must not sleep?
+static int
+holding_any(void)
+{
+  int n;
+
+  // push_off() itself adds one to noff.
+  push_off();
+  n = mycpu()->noff;
+  pop_off();
+  return n > 1;
+}
+
+// Fill in page va of v.  Whole pages of file data come
+// from the page cache, shared with every other mapping of
+// them (copy-on-write if v is writable); the partial last
+// page and the zero-fill tail get private pages.
+static int
+vma_fault(struct proc *p, struct vma *v, uint64 va, int write)
+{
+  uint64 pgoff = va - v->start, n, pa;
+  int perm = v->perm | PTE_U;
+  char *mem;
+
+  if(write && (v->perm & PTE_W) == 0)
+    return -1;
+
+  n = 0;
+  if(pgoff < v->filesz)
+    n = v->filesz - pgoff < PGSIZE ? v->filesz - pgoff : PGSIZE;
+  // reading the file may sleep.
+  if(n > 0 && holding_any())
+    return -1;
+
+  if(n > 0 && (v->flags & MAP_SHARED)){
+    // every mapping sees the cached page, pinned there
+    // until unmapped.  It is mapped writable only once
+    // written to, which marks it dirty.
+    ilock(v->ip);
+    pa = pcache_get(v->ip, v->off + pgoff, 1);
+    iunlock(v->ip);
+    if(pa == 0)
+      return -1;
+    if(!write)
+      perm &= ~PTE_W;
+  } else if(n == PGSIZE && (v->off + pgoff) % PGSIZE == 0 && !write){
+    ilock(v->ip);
+    pa = pcache_get(v->ip, v->off + pgoff, 0);
+    iunlock(v->ip);
+    if(pa == 0)
+      return -1;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else {
+    if((mem = kzalloc()) == 0)
+      return -1;
+    if(n > 0){
+      ilock(v->ip);
+      if(readi(v->ip, 0, (uint64)mem, v->off + pgoff, n) != n){
+        iunlock(v->ip);
+        kfree(mem);
+        return -1;
+      }
+      iunlock(v->ip);
+    }
+    pa = (uint64)mem;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, pa, perm) != 0){
+    if(n > 0 && (v->flags & MAP_SHARED))
+      pcache_unpin(pa);
+    kfree((void*)pa);
+    return -1;
+  }
+  return 0;
+}
+
+// Is page va of v a pinned page-cache page, once present?
+static int
+vma_pinned(struct vma *v, uint64 va)
+{
+  return (v->flags & MAP_SHARED) && v->ip && va - v->start < v->filesz;
+}
+
+// Drop the page-cache pins of v's present pages in [a, b),
+// before unmapping them.
+static void
+vma_unpin(struct proc *p, struct vma *v, uint64 a, uint64 b)
+{
+  uint64 va;
+  pte_t *pte;
+
+  for(va = a; va < b; va += PGSIZE){
+    if(!vma_pinned(v, va))
+      continue;
+    if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V))
+      pcache_unpin(PTE2PA(*pte));
+  }
+}
+
+// Back the whole 2 MiB-aligned stretch of heap around va
+// with one superpage, if all of it is below p->sz, none of
+// it has been touched, and a free superpage is at hand.
+static int
+heap_super(struct proc *p, uint64 va)
+{
+  uint64 a = SUPERPGROUNDDOWN(va);
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(a + SUPERPGSIZE > p->sz)
+    return -1;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start < a + SUPERPGSIZE && v->end > a)
+      return -1;
+  if((pte = walklevel(p->pagetable, a, 1, 1)) == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc_order(SUPERORDER)) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_V;
+  return 0;
+}
+
+// Handle a page fault at va in p's address space: fill in
+// a demand-paged region, give a lazily allocated heap page
+// its memory, or resolve a store to a copy-on-write page.
+// Returns 0 if p may retry the access, -1 if va is a bad
+// address or memory ran out.
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  v = vma_find(p, va);
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return cowfault(p->pagetable, va);
+    if(write && v && (v->flags & MAP_SHARED) && (v->perm & PTE_W)){
+      *pte |= PTE_W;
+      sfence_vma();
+      return 0;
+    }
+    return -1;
+  }
+  if(v)
+    return vma_fault(p, v, va, write);
+  if(va >= p->sz)
+    return -1;
+  if(heap_super(p, va) == 0)
+    return 0;
+  if((mem = kzalloc()) == 0)
+    return -1;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the not yet present file-backed pages of
+// [va, va+len) in the current process, before a system
+// call copies to or from them while holding locks.
+void
+vma_prefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a, last;
+  pte_t *pte;
+
+  if(va + len < va || va + len > MAXVA)
+    return;
+  last = PGROUNDDOWN(va + len - 1);
+  for(a = PGROUNDDOWN(va); a <= last; a += PGSIZE){
+    if(vma_find(p, a) == 0)
+      continue;
+    if((pte = walk(p->pagetable, a, 0)) != 0 && (*pte & PTE_V))
+      continue;
+    vmfault(p, a, 0);
+  }
+}
+
+// Give np copies of p's regions, for fork.  Program
+// segments lie below p->sz, where uvmcopy() copies the
+// pages; the pages of mmap() regions are copied here,
+// shared ones staying shared.  Returns 0 on success,
+// -1 if out of memory.
+int
+vma_dup(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint64 va, pa;
+  uint flags;
+
+  tlb_flush(p->pagetable);
+  for(int i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    np->vma[i] = *v;
+    if(v->end == 0)
+      continue;
+    if(v->ip)
+      idup(v->ip);
+    if(v->flags == 0)
+      continue;
+    for(va = v->start; va < v->end; va += PGSIZE){
+      if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if((v->flags & MAP_PRIVATE) && (flags & PTE_W)){
+        flags ^= PTE_COW ^ PTE_W;
+        *pte = PA2PTE(pa) | flags;
+      }
+      increment(pa);
+      if(mappages(np->pagetable, va, PGSIZE, pa, flags) != 0){
+        kfree((void*)pa);
+        return -1;
+      }
+      if(vma_pinned(v, va))
+        pcache_pin(pa);
+    }
+  }
+  return 0;
+}
+
+// Lowest address of p's mmap() regions, or TRAPFRAME;
+// the heap may grow up to it.
+uint64
+vma_base(struct proc *p)
+{
+  uint64 base = TRAPFRAME;
+
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->flags && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Write the dirty pages of v in [a, b) back to its file,
+// without growing the file.  A shared page is dirty if it
+// has been made writable.
+static void
+vma_writeback(struct proc *p, struct vma *v, uint64 a, uint64 b)
+{
+  uint64 va, off, n;
+  pte_t *pte;
+
+  if((v->flags & MAP_SHARED) == 0 || v->ip == 0)
+    return;
+  tlb_flush(p->pagetable);
+  for(va = a; va < b; va += PGSIZE){
+    if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & (PTE_V|PTE_W)) != (PTE_V|PTE_W))
+      continue;
+    off = v->off + (va - v->start);
+    begin_op();
+    ilock(v->ip);
+    if(off < v->ip->size){
+      n = v->ip->size - off < PGSIZE ? v->ip->size - off : PGSIZE;
+      writei(v->ip, 0, PTE2PA(*pte), off, n);
+    }
+    iunlock(v->ip);
+    end_op();
+    *pte &= ~PTE_W;
+  }
+  sfence_vma();
+}
+
+// Drop all of p's regions, writing back shared mappings
+// and unmapping mmap() regions; the pages of program
+// segments are freed with the rest of p's memory.
+void
+vma_free(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    if(v->flags){
+      vma_writeback(p, v, v->start, v->end);
+      vma_unpin(p, v, v->start, v->end);
+      uvmunmap(p->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+    }
+    if(v->ip){
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Map len bytes of ip (or zeroes, if ip is 0) from offset
+// off into the current process, below its other mmap()
+// regions.  Returns the address, or -1.
+uint64
+vma_mmap(uint64 len, int perm, int flags, struct inode *ip, uint64 off, uint64 filesz)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free = 0;
+  uint64 va, a;
+  char *mem;
+
+  len = PGROUNDUP(len);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0 && free == 0)
+      free = v;
+  va = vma_base(p);
+  if(free == 0 || len == 0 || len > va || va - len < PGROUNDUP(p->sz))
+    return -1;
+  va -= len;
+
+  free->start = va;
+  free->end = va + len;
+  free->perm = perm;
+  free->flags = flags;
+  free->ip = ip ? idup(ip) : 0;
+  free->off = off;
+  free->filesz = filesz;
+
+  if(ip == 0 && (flags & MAP_SHARED)){
+    // no file to meet in: allocate every page now, so a
+    // later fork() shares all of them with the child.
+    for(a = va; a < va + len; a += PGSIZE){
+      if((mem = kzalloc()) == 0 ||
+         mappages(p->pagetable, a, PGSIZE, (uint64)mem, perm | PTE_U) != 0){
+        if(mem)
+          kfree(mem);
+        uvmunmap(p->pagetable, va, (a - va) / PGSIZE, 1);
+        memset(free, 0, sizeof(*free));
+        return -1;
+      }
+    }
+  }
+  return va;
+}
+
+// Unmap [va, va+len) from the current process's mmap()
+// regions, writing back shared pages.  A region may shrink
+// at either end or be split in two.  Returns 0, or -1 if
+// va isn't page-aligned or a split needs a free slot.
+int
+vma_munmap(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free;
+  uint64 a, b, end;
+
+  if(va % PGSIZE != 0 || va + len < va)
+    return -1;
+  end = PGROUNDUP(va + len);
+
+  free = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0 && free == 0)
+      free = v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->flags == 0 || end <= v->start || va >= v->end)
+      continue;
+    a = va > v->start ? va : v->start;
+    b = end < v->end ? end : v->end;
+    if(a > v->start && b < v->end){
+      if(free == 0)
+        return -1;
+      // keep [b, end) in a new region.
+      *free = *v;
+      free->start = b;
+      free->off += b - v->start;
+      free->filesz = free->filesz > b - v->start ? free->filesz - (b - v->start) : 0;
+      if(free->ip)
+        idup(free->ip);
+      v->end = b;
+      free = 0;
+    }
+    vma_writeback(p, v, a, b);
+    vma_unpin(p, v, a, b);
+    uvmunmap(p->pagetable, a, (b - a) / PGSIZE, 1);
+    if(a == v->start && b == v->end){
+      if(v->ip){
+        begin_op();
+        iput(v->ip);
+        end_op();
+      }
+      memset(v, 0, sizeof(*v));
+    } else if(a == v->start){
+      v->off += b - a;
+      v->filesz = v->filesz > b - a ? v->filesz - (b - a) : 0;
+      v->start = b;
+    } else {
+      v->end = a;
+    }
+  }
+  return 0;
+}
+
+// Physical address of the user page va0 for copyin, or
+// for copyout if write is set; 0 if it can't be accessed
+// that way.  A page of the current process that hasn't
+// been touched yet is faulted in, and one that is shared
+// copy-on-write is copied before a write.  The current
+// process's last translation is cached in p->tlb_*, so
+// runs of small copies to one page skip the walk.
+static uint64
+uvmaddr(pagetable_t pagetable, uint64 va0, int write)
+{
+  struct proc *p = myproc();
+  int mine = p != 0 && p->pagetable == pagetable;
+  uint64 pa0;
+  pte_t *pte;
+
+  if(mine && p->tlb_pa && p->tlb_va == va0 && (p->tlb_write || !write))
+    return p->tlb_pa;
+
+  pa0 = walkaddr(pagetable, va0);
+  if(pa0 == 0 && mine && vmfault(p, va0, 0) == 0)
+    pa0 = walkaddr(pagetable, va0);
+  if(pa0 == 0)
+    return 0;
+  pte = walk(pagetable, va0, 0);
+  if(write && (*pte & PTE_W) == 0){
+    // never write through to a page shared copy-on-write,
+    // or to read-only text that other processes share.
+    if(!mine || vmfault(p, va0, 1) < 0)
+      return 0;
+    pa0 = walkaddr(pagetable, va0);
+    pte = walk(pagetable, va0, 0);
+  }
+  if(mine){
+    p->tlb_va = va0;
+    p->tlb_pa = pa0;
+    p->tlb_write = (*pte & PTE_W) != 0;
+  }
+  return pa0;
+}
+
 int
 uvmcopy2(pagetable_t old, pagetable_t new, uint64 sz)
 {
@@ -340,10 +962,8 @@ uvmcopy2(pagetable_t old, pagetable_t new, uint64 sz)
   char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // lazy page, not yet touched
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
     if((mem = kalloc()) == 0)
@@ -384,7 +1004,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -409,7 +1029,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -436,7 +1056,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGSIZE + 1;  // header block, then data
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -77,8 +77,17 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  if(nlog - 1 < LOGSIZE || nlog - 1 > MAXLOG){
+    fprintf(stderr, "mkfs: log must be %d to %d blocks\n", LOGSIZE + 1, (int)MAXLOG + 1);
     exit(1);
   }
 
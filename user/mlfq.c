@@ -0,0 +1,43 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+#include "kernel/spinlock.h"
+#include "kernel/proc.h"
+#include "user/user.h"
+
+// mlfq                      print the scheduler settings
+// mlfq q1 q2 q3 boost       set the per-level time slices
+//                           and the boost period, in ticks
+int main(int argc, char *argv[])
+{
+  struct mlfq_conf c;
+
+  if (argc != 1 && argc != NMLFQ + 2) {
+    fprintf(2, "usage: mlfq [q1 q2 q3 boost]\n");
+    exit(1);
+  }
+
+  if (argc > 1) {
+    for (int i = 0; i < NMLFQ; i++)
+      c.quantum[i] = atoi(argv[i + 1]);
+    c.boost = atoi(argv[NMLFQ + 1]);
+    if (mlfq(&c, 0) < 0) {
+      fprintf(2, "mlfq: time slices must be positive\n");
+      exit(1);
+    }
+  }
+
+  if (mlfq(0, &c) < 0)
+    exit(1);
+
+  for (int i = 0; i < NMLFQ; i++)
+    printf("level %d: %d ticks\n", i + 1, c.quantum[i]);
+  if (c.boost)
+    printf("boost: every %d ticks\n", c.boost);
+  else
+    printf("boost: off\n");
+
+  exit(0);
+}
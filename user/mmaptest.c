@@ -0,0 +1,93 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define N 6000  // a bit over a page, so the last one is partial
+
+char buf[N], want[N];
+
+void
+fail(char *what)
+{
+  fprintf(2, "mmaptest: %s failed\n", what);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int fd, i;
+  char *p;
+
+  for (i = 0; i < N; i++)
+    buf[i] = 'a' + i % 26;
+  if ((fd = open("mmap.tmp", O_CREATE | O_RDWR)) < 0 || write(fd, buf, N) != N)
+    fail("create");
+
+  // a private mapping reads the file, and writes stay private.
+  if ((p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    fail("private mmap");
+  for (i = 0; i < N; i++)
+    if (p[i] != buf[i])
+      fail("private read");
+  p[0] = 'X';
+  if (munmap(p, N) < 0)
+    fail("private munmap");
+
+  // a shared mapping writes back on munmap.
+  if ((p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    fail("shared mmap");
+  if (p[0] != 'a')
+    fail("private write stayed private");
+  p[1] = 'Y';
+  p[N - 1] = 'Z';
+  if (munmap(p, N) < 0)
+    fail("shared munmap");
+  close(fd);
+
+  if ((fd = open("mmap.tmp", O_RDONLY)) < 0 || read(fd, buf, N) != N)
+    fail("reread");
+  if (buf[0] != 'a' || buf[1] != 'Y' || buf[N - 1] != 'Z')
+    fail("shared write back");
+  close(fd);
+
+  // stores to every page of a shared mapping all reach the file,
+  // and a write() meanwhile changes only the bytes it writes.
+  if ((fd = open("mmap.tmp", O_RDWR)) < 0)
+    fail("open");
+  if ((p = mmap(0, N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    fail("shared mmap 2");
+  for (i = 0; i < N; i++)
+    p[i] = want[i] = 'A' + i % 23;
+  if (write(fd, "123", 3) != 3)
+    fail("write under mapping");
+  memmove(want, "123", 3);
+  if (p[0] != '1' || p[2] != '3' || p[3] != want[3])
+    fail("mapping sees write");
+  if (munmap(p, N) < 0)
+    fail("shared munmap 2");
+  close(fd);
+
+  if ((fd = open("mmap.tmp", O_RDONLY)) < 0 || read(fd, buf, N) != N)
+    fail("reread 2");
+  for (i = 0; i < N; i++)
+    if (buf[i] != want[i])
+      fail("multi-page write back");
+
+  // a child shares a MAP_SHARED anonymous page with its parent.
+  if ((p = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    fail("anonymous mmap");
+  p[0] = 1;
+  if (fork() == 0) {
+    p[0] = 2;
+    exit(0);
+  }
+  wait(0);
+  if (p[0] != 2)
+    fail("shared anonymous");
+
+  close(fd);
+  unlink("mmap.tmp");
+  printf("mmaptest: ok\n");
+  exit(0);
+}
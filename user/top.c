@@ -17,7 +17,7 @@ char *state_name[] = {
 };
 
 inline void clear_screen(int n) {
-  for (int i = 0; i < n + 8; i++) {
+  for (int i = 0; i < n + 11; i++) {
     printf("\033[A");
     printf("\33[2K\r");
   }
@@ -46,12 +46,25 @@ int main(int argc, char *argv[])
       printf("sleeping process:%d\n", t.sleeping_process);
       printf("total memory:%d KB\n", (t.total_pages * PGSIZE) >> 10LL);
       printf("memory usage:%d KB\n", (t.used_pages * PGSIZE) >> 10LL);
-      printf("process data:\nname\tPID\tPPID\tstate\ttime\tCPU%%\tmem%%\n");
+      printf("buddy free:");
+      for (int i = 0; i <= KMAXORDER; i++)
+        printf(" %d", t.buddy_free[i]);
+      printf("\n");
+      printf("slabs:");
+      for (int i = 0; i < t.nslab; i++)
+        printf(" %s %d/%d (peak %d)", t.slab[i].name, t.slab[i].inuse, t.slab[i].total, t.slab[i].peak);
+      printf("\n");
+      printf("cpu idle:");
+      for (int i = 0; i < t.ncpu; i++)
+        printf(" %d:%ds", i, t.idle_time[i] / 10000000);
+      printf("\n");
+      printf("process data:\nname\tPID\tPPID\tstate\ttime\tCPU%%\tmem%%\tcow copy/reuse\n");
       for (int i = 0; i < x; i++) {
-        printf("%s\t%d\t%d\t%s\t%d\t%d.%d\t%d.%d\n",
+        printf("%s\t%d\t%d\t%s\t%d\t%d.%d\t%d.%d\t%d/%d\n",
         t.p_list[i].name, t.p_list[i].pid, t.p_list[i].ppid, state_name[t.p_list[i].state], t.p_list[i].ctime / 100,
         t.p_list[i].rtime * 100L / t.uptime, (t.p_list[i].rtime * 10000L / t.uptime) % 100,
-        t.p_list[i].sz * 100L / (t.total_pages * PGSIZE), (t.p_list[i].sz * 10000L / (t.total_pages * PGSIZE)) % 100);
+        t.p_list[i].sz * 100L / (t.total_pages * PGSIZE), (t.p_list[i].sz * 10000L / (t.total_pages * PGSIZE)) % 100,
+        t.p_list[i].cow_copies, t.p_list[i].cow_reuse);
       }
 
       sleep(200);
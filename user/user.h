@@ -4,6 +4,7 @@ struct top;
 struct child_processes;
 struct report;
 struct report_traps;
+struct mlfq_conf;
 
 // system calls
 int fork(void);
@@ -31,6 +32,11 @@ int histry(stringData*);
 int ttop(struct top*);
 int chp(struct child_processes*);
 int rptrap(struct report_traps*);
+int mlfq(struct mlfq_conf*, struct mlfq_conf*);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int splice(int, int, int);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
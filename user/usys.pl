@@ -40,3 +40,8 @@ entry("histry");
 entry("ttop");
 entry("chp");
 entry("rptrap");
+entry("mlfq");
+entry("mmap");
+entry("munmap");
+entry("splice");
+entry("fsync");